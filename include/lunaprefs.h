@@ -23,6 +23,8 @@
 #define _LUNAPREFS_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <glib.h>
 #ifdef USE_MJSON
 #include <json.h>
 #endif
@@ -35,6 +37,42 @@ extern "C" {
 
 typedef int LPErr;
 typedef void* LPAppHandle;
+typedef void* LPAppIterator;
+typedef void* LPAppBackup;
+
+/* How hard an app DB works to survive a power loss.
+ *
+ * LP_DURABILITY_STRICT: synchronous=FULL.  On a new DB that means sqlite's
+ * rollback journal and several fsyncs per commit.
+ *
+ * LP_DURABILITY_WAL: write-ahead log with synchronous=NORMAL.  A commit is
+ * one sequential append with no fsync, readers don't block the writer, and
+ * a power loss can lose the most recent commits but can't corrupt the DB.
+ * Switching a DB to WAL is sticky: it stays a WAL DB for all who open it.
+ */
+typedef enum {
+    LP_DURABILITY_STRICT = 0,
+    LP_DURABILITY_WAL
+} LPDurability;
+
+/* Where app DBs live.
+ *
+ * LP_STORAGE_PER_APP: each app has a DB of its own,
+ * /var/preferences/<appId>/prefsDB.sl.
+ *
+ * LP_STORAGE_SHARED: all apps share /var/preferences/appPrefsDB.sl, keyed by
+ * (appId, key): one file to open, journal and fsync rather than hundreds.
+ * An app's own DB, if it has one, is moved into the shared DB and deleted
+ * the first time it's opened.
+ *
+ * LP_STORAGE_AUTO, the default: shared if the shared DB exists, so once one
+ * process has switched, everyone using the library follows.
+ */
+typedef enum {
+    LP_STORAGE_AUTO = 0,
+    LP_STORAGE_PER_APP,
+    LP_STORAGE_SHARED
+} LPStorageMode;
 
 /* error codes.  These need to be integrated with other luna codes, I suspect */
 #define LP_ERR_NONE            0
@@ -50,6 +88,8 @@ typedef void* LPAppHandle;
 #define LP_ERR_NOTIMPL        10 /* feature not implemented */
 #define LP_ERR_INTERNAL       11 /* some component I called reported failure */
 #define LP_ERR_DBERROR        12
+#define LP_ERR_READONLY       13 /* attempt to write through a snapshot handle */
+#define LP_ERR_VERSION_MISMATCH 14 /* compare-and-set lost: the value has moved on */
 
     /**
      * Add a file FOO with contents "BAR" to this directory and you now have a
@@ -74,6 +114,28 @@ LPErr LPAppClearData( const char* appId );
 
 LPErr LPAppGetHandle( const char* appId, LPAppHandle* handle );
 
+/**
+ * LPAppGetSnapshotHandle
+ *
+ * Get a read-only handle on the app's values as they are now.  The library
+ * keeps a snapshot file for apps that have been asked for one, republished
+ * whenever a handle commits changes, and this handle maps it: LPAppCopyValue
+ * and LPAppCopyKeys (and their variants) are then answered from memory with
+ * no locking.  Values committed after the handle was got aren't seen; get
+ * another handle to see them.  The other getters, and all of them if no
+ * snapshot could be had, go to the DB.  Setters fail with LP_ERR_READONLY.
+ * Free it with LPAppFreeHandle.
+ */
+LPErr LPAppGetSnapshotHandle( const char* appId, LPAppHandle* handle );
+
+/**
+ * LPAppSetStorageMode
+ *
+ * Choose where handles got from now on by this process keep their data.
+ * See LPStorageMode.
+ */
+LPErr LPAppSetStorageMode( LPStorageMode mode );
+
 /**
  * @param handle     returned via LPAppGetHandle.
  *
@@ -83,6 +145,101 @@ LPErr LPAppGetHandle( const char* appId, LPAppHandle* handle );
  */
 LPErr LPAppFreeHandle( LPAppHandle handle, bool commit );
 
+/**
+ * LPAppFlushHandle
+ *
+ * Like LPAppFreeHandle, but the handle stays valid and keeps its DB open so
+ * it can be reused.  The next call made against it begins a new
+ * transaction.  Meant for long-running clients that keep handles around.
+ *
+ * @param commit true means commit all statements actions made against
+ *                   this handle so far, false means roll them all back.
+ */
+LPErr LPAppFlushHandle( LPAppHandle handle, bool commit );
+
+/**
+ * LPAppHandleIsStale
+ *
+ * Set *stale if the DB the handle has open has since been cleared with
+ * LPAppClearData() or otherwise removed or replaced, so that anything
+ * written through it would be lost.  A long-lived handle found stale should
+ * be freed and a new one got.
+ */
+LPErr LPAppHandleIsStale( LPAppHandle handle, bool* stale );
+
+/**
+ * LPAppSetDefaultDurability
+ *
+ * Set the durability profile given to handles created from now on by this
+ * process.  LP_DURABILITY_STRICT unless changed.
+ */
+LPErr LPAppSetDefaultDurability( LPDurability durability );
+
+/**
+ * LPAppSetDurability
+ *
+ * Set the durability profile of one handle.  Takes effect when the handle
+ * opens its DB, or right away if it has already done so.  Returns
+ * LP_ERR_BUSY if the handle is in the middle of a transaction; call
+ * LPAppFlushHandle first.
+ */
+LPErr LPAppSetDurability( LPAppHandle handle, LPDurability durability );
+
+/* Counters kept by the value cache; see LPAppSetCacheBudget */
+typedef struct LPAppCacheStats {
+    unsigned long hits;
+    unsigned long misses;         /* lookups that went on to the DB */
+    unsigned long evictions;      /* entries dropped to stay within budget */
+    unsigned long invalidations;  /* times an app's entries were all dropped */
+    size_t        bytes;          /* held right now */
+} LPAppCacheStats;
+
+/**
+ * LPAppSetCacheBudget
+ *
+ * Give the process-wide value cache up to bytes of memory, evicting least
+ * recently used values to get under it if need be.  0, the default, turns
+ * the cache off.  LPAppCopyValue and friends look values up by (appId, key)
+ * there before going to the DB.  Values are dropped when a handle commits
+ * writes to the app, and when a handle beginning a transaction finds the
+ * app's DB changed on disk by someone else; a handle with uncommitted writes
+ * of its own doesn't use the cache.
+ */
+LPErr LPAppSetCacheBudget( size_t bytes );
+
+/**
+ * LPAppGetCacheStats
+ *
+ * Copy the value cache's counters, accumulated since the process started.
+ */
+LPErr LPAppGetCacheStats( LPAppCacheStats* stats );
+
+/**
+ * LPAppCheckpoint
+ *
+ * Copy what's in the DB's write-ahead log, if it has one, back into the DB
+ * so the log can be reused.  sqlite does this on its own now and then, and
+ * when the last handle on a DB is freed; long-lived handles may want to do
+ * it when they're otherwise idle.  Returns LP_ERR_BUSY if the handle is in
+ * the middle of a transaction.
+ */
+LPErr LPAppCheckpoint( LPAppHandle handle );
+
+/**
+ * LPAppMaintain
+ *
+ * Tidy the handle's DB: give back to the filesystem up to pages pages (all
+ * of them if pages is 0) that removals have freed, refresh the statistics
+ * sqlite's query planner works from where they look stale, and checkpoint
+ * as LPAppCheckpoint does.  DBs created by this version of the library and
+ * later free pages incrementally; older ones keep theirs.  A DB unchanged
+ * since the process last maintained it is left alone, so in
+ * LP_STORAGE_SHARED mode one app's pass does for all.  Meant for idle
+ * time.  Returns LP_ERR_BUSY if the handle is in the middle of a
+ * transaction.
+ */
+LPErr LPAppMaintain( LPAppHandle handle, int pages );
+
 
 LPErr LPAppCopyValue( LPAppHandle handle, const char* key, char** jstr );
     /** LPAppCopyValueString 
@@ -97,6 +254,30 @@ LPErr LPAppCopyValueJ( LPAppHandle handle, const char* key, json_t** json );
 #endif
 LPErr LPAppCopyValueCJ( LPAppHandle handle, const char* key, struct json_object** json );
 
+/**
+ * LPAppCopyValueVersioned
+ *
+ * LPAppCopyValue, also returning the value's version.  Every key's version
+ * starts at 1 and goes up by one with each change to it; a key removed and
+ * set again, even after LPAppClearData, carries on above where it was
+ * rather than repeating one.  Pass it to LPAppCompareAndSetValue to update
+ * the value only if nobody else has.
+ */
+LPErr LPAppCopyValueVersioned( LPAppHandle handle, const char* key, char** jstr,
+                               long long* version );
+
+/**
+ * LPAppCopyValues
+ *
+ * Look up n keys in one go.  On return jstrs[i] holds the value for keys[i],
+ * g_malloc'd as with LPAppCopyValue, or NULL if it couldn't be had; in that
+ * case errs[i], if errs isn't NULL, says why (LP_ERR_NO_SUCH_KEY, say).  The
+ * function's result is LP_ERR_NONE unless the DB itself failed.  Caller must
+ * g_free each non-NULL element of jstrs.
+ */
+LPErr LPAppCopyValues( LPAppHandle handle, const char* const keys[],
+                       char* jstrs[], LPErr errs[], int n );
+
 LPErr LPAppSetValue( LPAppHandle handle, const char* key, const char* const jstr );
     /** LPAppSetValueString 
      *
@@ -110,8 +291,96 @@ LPErr LPAppSetValueJ( LPAppHandle handle, const char* key, const json_t* json );
 #endif
 LPErr LPAppSetValueCJ( LPAppHandle handle, const char* key, struct json_object* json );
 
+/**
+ * LPAppCompareAndSetValue
+ *
+ * Store jstr under key only if the key's version is still expectedVersion,
+ * as got from LPAppCopyValueVersioned; an expectedVersion of 0 means the key
+ * mustn't exist yet.  Otherwise nothing is written and the result is
+ * LP_ERR_VERSION_MISMATCH: read the value again and retry.  On success the
+ * key's new version is put in *newVersion if that isn't NULL.
+ */
+LPErr LPAppCompareAndSetValue( LPAppHandle handle, const char* key,
+                               long long expectedVersion, const char* const jstr,
+                               long long* newVersion );
+
+/**
+ * LPAppSetValues
+ *
+ * Set n key/value pairs in one go.  Each value must be a json document, as
+ * with LPAppSetValue.  Either all of the pairs are stored or, if any one is
+ * refused, none are.  As with the other setters, the changes are made
+ * permanent when the handle's transaction is committed, so a batch costs
+ * one commit rather than n.
+ */
+LPErr LPAppSetValues( LPAppHandle handle, const char* const keys[],
+                      const char* const jstrs[], int n );
+
+/**
+ * LPAppPatchValue
+ *
+ * Apply patch, an RFC 7386 JSON merge patch, to the value stored under key
+ * and store the result: members of the patch replace those of the value,
+ * recursively for objects, and members set to null are removed.  A key that
+ * doesn't exist yet is patched as if it were null.  The result has to be a
+ * legal value, an object or array, or LP_ERR_VALUENOTJSON is returned and
+ * nothing is stored.
+ */
+LPErr LPAppPatchValue( LPAppHandle handle, const char* key, const char* const patch );
+
 LPErr LPAppRemoveValue( LPAppHandle handle, const char* key );
 
+/*
+ * Async app prefs.  Each of these queues the call for a thread the library
+ * keeps for the purpose, so the caller never waits on the DB, and returns
+ * at once.  The callback is later run on context (the default main context
+ * if NULL), with the result and userData; jstr there belongs to the library
+ * and is gone once the callback returns.  Calls are carried out in the order
+ * made, each in a transaction of its own.  There's no handle: the worker
+ * thread keeps its own, since sqlite connections aren't to be shared
+ * between threads.
+ */
+typedef void (*LPAppValueCallback)( LPErr err, const char* jstr, void* userData );
+typedef void (*LPAppDoneCallback)( LPErr err, void* userData );
+
+/** LPAppCopyValue, asynchronously */
+LPErr LPAppCopyValueAsync( const char* appId, const char* key,
+                           GMainContext* context,
+                           LPAppValueCallback callback, void* userData );
+/** LPAppCopyKeysWithPrefix, asynchronously.  prefix may be NULL. */
+LPErr LPAppCopyKeysAsync( const char* appId, const char* prefix,
+                          GMainContext* context,
+                          LPAppValueCallback callback, void* userData );
+/** LPAppCopyAllWithPrefix, asynchronously.  prefix may be NULL. */
+LPErr LPAppCopyAllAsync( const char* appId, const char* prefix,
+                         GMainContext* context,
+                         LPAppValueCallback callback, void* userData );
+/** LPAppSetValue, asynchronously.  callback may be NULL. */
+LPErr LPAppSetValueAsync( const char* appId, const char* key, const char* jstr,
+                          GMainContext* context,
+                          LPAppDoneCallback callback, void* userData );
+/** LPAppRemoveValue, asynchronously.  callback may be NULL. */
+LPErr LPAppRemoveValueAsync( const char* appId, const char* key,
+                             GMainContext* context,
+                             LPAppDoneCallback callback, void* userData );
+
+/*
+ * Online backup of an app's DB (of the shared DB, in LP_STORAGE_SHARED
+ * mode) to path, while others go on using it.  LPAppBackupBegin starts one;
+ * each LPAppBackupStep copies at most pages pages, and sets *done once the
+ * copy is complete -- call it from idle time until then, with no lock held
+ * between calls.  It returns LP_ERR_BUSY if a writer holds the DB just
+ * then; call it again later.  LPAppBackupFinish puts the copy at path if
+ * it's complete and frees the backup in any case; nothing is ever written
+ * to path itself but a complete copy.  Finishing an incomplete backup
+ * returns LP_ERR_BUSY.  The copy is made in path.<pid> first, which must
+ * not exist as anything but a regular file.  Writes by others restart the
+ * copy; once that has happened a few times a step copies the rest at once.
+ */
+LPErr LPAppBackupBegin( const char* appId, const char* path, LPAppBackup* backup );
+LPErr LPAppBackupStep( LPAppBackup backup, int pages, bool* done );
+LPErr LPAppBackupFinish( LPAppBackup backup );
+
 /**
  * LPAppCopyKeys
  * 
@@ -125,6 +394,17 @@ LPErr LPAppCopyKeysJ( LPAppHandle handle, json_t** json );
 #endif
 LPErr LPAppCopyKeysCJ( LPAppHandle handle, struct json_object** json );
 
+/**
+ * LPAppCopyKeysWithPrefix
+ *
+ * As LPAppCopyKeys, but only the keys beginning with prefix, e.g.
+ * "account.1234." -- found with a range scan on the key index rather than
+ * by reading the whole DB.  A NULL or empty prefix matches every key.
+ */
+LPErr LPAppCopyKeysWithPrefix( LPAppHandle handle, const char* prefix, char** jstr );
+LPErr LPAppCopyKeysWithPrefixCJ( LPAppHandle handle, const char* prefix,
+                                 struct json_object** json );
+
 /**
  * LPAppCopyAll
  * 
@@ -138,6 +418,58 @@ LPErr LPAppCopyAllJ( LPAppHandle handle, json_t** json );
 #endif
 LPErr LPAppCopyAllCJ( LPAppHandle handle, struct json_object** json );
 
+/**
+ * LPAppCopyAllWithPrefix
+ *
+ * As LPAppCopyAll, but only the pairs whose key begins with prefix.  See
+ * LPAppCopyKeysWithPrefix.
+ */
+LPErr LPAppCopyAllWithPrefix( LPAppHandle handle, const char* prefix, char** jstr );
+LPErr LPAppCopyAllWithPrefixCJ( LPAppHandle handle, const char* prefix,
+                                struct json_object** json );
+
+/**
+ * LPAppCopyChangesSince
+ *
+ * What's changed in the app's values since sequence number seq.  Every
+ * write and every removal is given the app's next sequence number; the
+ * result is
+ *
+ *   { "seq": n, "changed": [ {"key": k, "value": v, "seq": s}, ... ],
+ *     "removed": [ {"key": k, "seq": s}, ... ] }
+ *
+ * listing each key changed or removed since seq once, as it is now, in
+ * sequence order.  n is the last number given out: pass it next time to
+ * get only what's changed since this call.  Pass 0 to get everything.
+ * Numbering carries on across LPAppClearData().  A seq from before the
+ * last LPAppClearData(), whose removals aren't listed, or one larger than
+ * any given out (the DB was removed some other way) gets everything, with
+ * "reset": true added: drop whatever was got before.
+ */
+LPErr LPAppCopyChangesSince( LPAppHandle handle, long long seq, char** jstr );
+LPErr LPAppCopyChangesSinceCJ( LPAppHandle handle, long long seq,
+                               struct json_object** json );
+
+/**
+ * LPAppIterBegin, LPAppIterNext, LPAppIterEnd
+ *
+ * Walk the key/value pairs whose key begins with prefix (NULL or "" for all
+ * of them) one at a time, in key order, without building them all into a
+ * json array first -- so a big DB can be walked in constant memory.
+ *
+ * LPAppIterNext sets *key and *jstr to buffers that belong to the iterator
+ * and are good only until the next call to LPAppIterNext or LPAppIterEnd.
+ * It returns LP_ERR_NO_SUCH_KEY when there are no more pairs, and goes on
+ * returning it if called again; a DB error ends the walk the same way once
+ * it's been returned.  LP_ERR_VALUENOTJSON is for a pair whose stored value
+ * isn't a json document; the walk can continue past that.
+ *
+ * Every iterator must be ended before its handle is flushed or freed.
+ */
+LPErr LPAppIterBegin( LPAppHandle handle, const char* prefix, LPAppIterator* iter );
+LPErr LPAppIterNext( LPAppIterator iter, const char** key, const char** jstr );
+LPErr LPAppIterEnd( LPAppIterator iter );
+
 
 /*
  * Sys prefs.  There's one DB conceptually.  In reality the values can
@@ -205,6 +537,38 @@ LPErr LPSystemCopyAllPublicCJ( struct json_object** json ); /* for use by the se
 
 LPErr LPSystemKeyIsPublic( const char* key, bool* allowedOnPublicBus ); /* for use by the service only */
 
+/**
+ * LPSystemCacheInvalidate
+ *
+ * System property values are cached for as long as their source allows --
+ * for good, for most -- and so are the lists of property files.  Forget the
+ * value of key, or everything if key is NULL, so the next call works it out
+ * afresh.  For whoever has just changed a property.
+ */
+LPErr LPSystemCacheInvalidate( const char* key );
+
+/**
+ * LPSystemSetStorageDevice
+ *
+ * Name the block device (as in /sys/block, e.g. "mmcblk0", the default if
+ * NULL) whose size com.palm.properties.storageCapacity reports.  Only
+ * letters, digits, '_' and '-' are allowed.
+ */
+LPErr LPSystemSetStorageDevice( const char* device );
+
+/**
+ * LPSystemWatchProperties
+ *
+ * Have the cache hear about changes to the property files as they happen,
+ * using inotify from a source attached to context (the default main
+ * context if NULL), so it drops just the values that changed and needn't
+ * expire the rest.  For long-running processes with a main loop.  Returns
+ * LP_ERR_SYSCONFIG if none of the directories could be watched yet; the
+ * runtime directory is watched once it turns up, including after it's been
+ * removed and made again.
+ */
+LPErr LPSystemWatchProperties( GMainContext* context );
+
 /**
  * LPErrorString
  * 
@@ -27,10 +27,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/types.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/vfs.h>
+#include <sys/inotify.h>
 
 #ifdef USE_MJSON
 #include <json.h>
@@ -38,14 +41,6 @@
 #include <cjson/json.h>
 #include <nyx/nyx_client.h>
 /* todo:
- *
- * set auto-vaccuum property
- *
- * compile two parameterized statements, the getter and setter.  But where do
- * they live?  Do I keep them in globals?  Would make sense if I'm being
- * called by a service that has state, but not if I'm just an API.  Maybe
- * they're in the handle.  That'd be an optimization for the case where a
- * handle is kept across a number of get/set calls.
  *
  * Versioning.  In table name alone for now?
  *
@@ -81,6 +76,13 @@
 # define LOG_OUT(res)
 #endif
 
+#define APP_PREFS_DIR "/var/preferences"
+#define APP_DB_NAME "prefsDB.sl"              /* in APP_PREFS_DIR/<appId>/ */
+#define SHARED_DB_PATH APP_PREFS_DIR "/appPrefsDB.sl"  /* all apps in one */
+#define SNAPSHOT_NAME "prefsSnapshot.bin"     /* in APP_PREFS_DIR/<appId>/, or
+                                                 APP_PREFS_DIR/<appId>. if shared */
+#define SEQ_FLOOR_NAME "seqFloor"             /* in APP_PREFS_DIR/<appId>/ */
+
 #define PROPS_DIR "/etc/prefs/properties"
 #define WHITELIST_PATH "/etc/prefs/public_properties"
 #define TOKENS_DIR "/dev/tokens"
@@ -102,17 +104,212 @@
 #define PROP_NAME_FREESPACE       "storageFreeSpace"
 #define PROP_NAME_PREVPANIC       "prevBootPanicked"
 #define PROP_NAME_PREVSHUTCLEAN   "prevShutdownClean"
+#define PROP_PREFIX_CMDLINE       "cmdline."  /* + a kernel command line name */
+
+#define STORAGE_DEVICE_DEFAULT    "mmcblk0"   /* see LPSystemSetStorageDevice() */
 
 
 static const char* PALM_TOKEN_PREFIX = "com.palm.properties.";
 
+/* Statements used against an app's DB.  Each is compiled the first time a
+ * handle needs it and then kept in the handle until LPAppFreeHandle(), so a
+ * handle that's kept across a number of get/set calls only pays for parsing
+ * once.  Parameters are bound by name.
+ */
+typedef enum {
+    STMT_GET_VALUE,
+    STMT_SET_VALUE,
+    STMT_REMOVE_VALUE,
+    STMT_COPY_KEYS,
+    STMT_COPY_KEYS_RANGE,
+    STMT_COPY_KEYS_FROM,
+    STMT_COPY_ALL,
+    STMT_COPY_ALL_RANGE,
+    STMT_COPY_ALL_FROM,
+    STMT_CAS_UPDATE,
+    STMT_CAS_INSERT,
+    STMT_CHANGED_SINCE,
+    STMT_REMOVED_SINCE,
+    STMT_LAST_SEQ,
+    STMT_SEQ_FLOOR,
+    STMT_LAST_VERSION,
+    STMT_COUNT
+} StmtId;
+
+/* data.type says what we know about a row's value.  Every path that writes
+ * one checks it's a json document first, so only rows written before the
+ * column existed -- and that the migration couldn't vouch for -- are
+ * UNCHECKED, and only those need parsing on the way out. */
+#define VALUE_UNCHECKED 0
+#define VALUE_JSON      1
+
+/* PRAGMA user_version of an up-to-date DB; see migrateSchema() */
+#define SCHEMA_VERSION  5
+
+/* data.version counts the writes to a key, starting at 1; see
+ * LPAppCompareAndSetValue().  A tombstone keeps the version its key had,
+ * and the floor the largest the old DB gave out, so a key removed and set
+ * again carries on rather than repeating a version.  data.seq is the change journal: every write
+ * gives the row the app's next sequence number, and every removal leaves a
+ * row in tombstones with one, so LPAppCopyChangesSince() can find what's
+ * changed since any point with an index lookup.  The next number is one
+ * more than the largest in either table; tombstones are dropped when their
+ * key is set again.  A tombstone with no key marks the floor left by a DB
+ * that LPAppClearData() deleted (see SEQ_FLOOR_NAME), so numbers carry on
+ * from where the old DB's left off rather than starting again at 1.  The
+ * old DB's keys left no tombstones, so anyone holding a number at or below
+ * the floor has to start over; see LPAppCopyChangesSince(). */
+#define APP_NEXT_SEQ "1 + MAX( IFNULL( (SELECT MAX(seq) FROM data), 0 )," \
+    " IFNULL( (SELECT MAX(seq) FROM tombstones), 0 ) )"
+#define APP_LAST_VERSION "IFNULL( (SELECT version FROM data WHERE key = :key)," \
+    " MAX( IFNULL( (SELECT version FROM tombstones WHERE key = :key), 0 )," \
+    " IFNULL( (SELECT MAX(version) FROM tombstones WHERE key IS NULL), 0 ) ) )"
+
+static const char* g_stmt_sql[STMT_COUNT] = {
+    /* STMT_GET_VALUE */    "SELECT value,type,version FROM data WHERE key = :key;",
+    /* STMT_SET_VALUE */    "REPLACE INTO data( key, value, type, version, seq ) VALUES( :key, :value, 1,"
+                            " 1 + " APP_LAST_VERSION ","
+                            " " APP_NEXT_SEQ " );", /* not INSERT: no dups */
+    /* STMT_REMOVE_VALUE */ "DELETE FROM data WHERE key = :key;",
+    /* STMT_COPY_KEYS */    "SELECT key FROM data;",
+    /* STMT_COPY_KEYS_RANGE */ "SELECT key FROM data WHERE key >= :lo AND key < :hi;",
+    /* STMT_COPY_KEYS_FROM */  "SELECT key FROM data WHERE key >= :lo;",
+    /* STMT_COPY_ALL */     "SELECT key,value,type FROM data;",
+    /* STMT_COPY_ALL_RANGE */  "SELECT key,value,type FROM data WHERE key >= :lo AND key < :hi;",
+    /* STMT_COPY_ALL_FROM */   "SELECT key,value,type FROM data WHERE key >= :lo;",
+    /* STMT_CAS_UPDATE */   "UPDATE data SET value = :value, type = 1, version = version + 1,"
+                            " seq = " APP_NEXT_SEQ " WHERE key = :key AND version = :version;",
+    /* STMT_CAS_INSERT */   "INSERT OR IGNORE INTO data( key, value, type, version, seq )"
+                            " VALUES( :key, :value, 1, 1 + " APP_LAST_VERSION ", " APP_NEXT_SEQ " );",
+    /* STMT_CHANGED_SINCE */ "SELECT key,value,seq FROM data WHERE seq > :seq ORDER BY seq;",
+    /* STMT_REMOVED_SINCE */ "SELECT key,seq FROM tombstones WHERE seq > :seq AND key IS NOT NULL ORDER BY seq;",
+    /* STMT_LAST_SEQ */     "SELECT " APP_NEXT_SEQ " - 1;",
+    /* STMT_SEQ_FLOOR */    "SELECT IFNULL( (SELECT MAX(seq) FROM tombstones WHERE key IS NULL), 0 );",
+    /* STMT_LAST_VERSION */ "SELECT MAX( IFNULL( (SELECT MAX(version) FROM data), 0 ),"
+                            " IFNULL( (SELECT MAX(version) FROM tombstones), 0 ) );",
+};
+
+/* an app DB's tables.  APP_JOURNAL_SQL is also how migrateSchema() adds
+ * the journal to an older DB. */
+#define APP_JOURNAL_SQL "CREATE INDEX IF NOT EXISTS data_seq ON data( seq );" \
+    " CREATE TABLE IF NOT EXISTS tombstones( key TEXT PRIMARY KEY, seq INTEGER NOT NULL," \
+    " version INTEGER NOT NULL DEFAULT 0 );" \
+    " CREATE INDEX IF NOT EXISTS tombstones_seq ON tombstones( seq );" \
+    " CREATE TRIGGER IF NOT EXISTS data_bury BEFORE DELETE ON data BEGIN" \
+    " REPLACE INTO tombstones( key, seq, version )" \
+    " VALUES( OLD.key, " APP_NEXT_SEQ ", OLD.version ); END;" \
+    " CREATE TRIGGER IF NOT EXISTS data_unbury AFTER INSERT ON data BEGIN" \
+    " DELETE FROM tombstones WHERE key = NEW.key; END;"
+#define APP_TABLE_SQL "CREATE TABLE IF NOT EXISTS data( key TEXT PRIMARY KEY," \
+    " value TEXT, type INTEGER NOT NULL DEFAULT 0, version INTEGER NOT NULL DEFAULT 0," \
+    " seq INTEGER NOT NULL DEFAULT 0 ); " APP_JOURNAL_SQL
+
+/* The same, for the shared DB (see LPAppSetStorageMode()), where every app's
+ * keys live in one table.  getStmt() binds :app.  Sequence numbers are per
+ * app here too. */
+#define SHARED_NEXT_SEQ( app ) "1 + MAX(" \
+    " IFNULL( (SELECT MAX(seq) FROM appdata WHERE appId = " app "), 0 )," \
+    " IFNULL( (SELECT MAX(seq) FROM tombstones WHERE appId = " app "), 0 ) )"
+#define SHARED_LAST_VERSION "IFNULL( (SELECT version FROM appdata WHERE appId = :app AND key = :key)," \
+    " MAX( IFNULL( (SELECT version FROM tombstones WHERE appId = :app AND key = :key), 0 )," \
+    " IFNULL( (SELECT MAX(version) FROM tombstones WHERE appId = :app AND key IS NULL), 0 ) ) )"
+#define SHARED_JOURNAL_SQL "CREATE INDEX IF NOT EXISTS appdata_seq ON appdata( appId, seq );" \
+    " CREATE TABLE IF NOT EXISTS tombstones( appId TEXT, key TEXT, seq INTEGER NOT NULL," \
+    " version INTEGER NOT NULL DEFAULT 0, PRIMARY KEY( appId, key ) );" \
+    " CREATE INDEX IF NOT EXISTS tombstones_seq ON tombstones( appId, seq );" \
+    " CREATE TRIGGER IF NOT EXISTS appdata_bury BEFORE DELETE ON appdata BEGIN" \
+    " REPLACE INTO tombstones( appId, key, seq, version )" \
+    " VALUES( OLD.appId, OLD.key, " SHARED_NEXT_SEQ( "OLD.appId" ) ", OLD.version ); END;" \
+    " CREATE TRIGGER IF NOT EXISTS appdata_unbury AFTER INSERT ON appdata BEGIN" \
+    " DELETE FROM tombstones WHERE appId = NEW.appId AND key = NEW.key; END;"
+#define SHARED_TABLE_SQL "CREATE TABLE IF NOT EXISTS appdata( appId TEXT, key TEXT," \
+    " value TEXT, type INTEGER NOT NULL DEFAULT 0, version INTEGER NOT NULL DEFAULT 0," \
+    " seq INTEGER NOT NULL DEFAULT 0, PRIMARY KEY( appId, key ) ); " SHARED_JOURNAL_SQL
+
+static const char* g_shared_stmt_sql[STMT_COUNT] = {
+    /* STMT_GET_VALUE */    "SELECT value,type,version FROM appdata WHERE appId = :app AND key = :key;",
+    /* STMT_SET_VALUE */    "REPLACE INTO appdata( appId, key, value, type, version, seq ) VALUES( :app, :key, :value, 1,"
+                            " 1 + " SHARED_LAST_VERSION ","
+                            " " SHARED_NEXT_SEQ( ":app" ) " );",
+    /* STMT_REMOVE_VALUE */ "DELETE FROM appdata WHERE appId = :app AND key = :key;",
+    /* STMT_COPY_KEYS */    "SELECT key FROM appdata WHERE appId = :app;",
+    /* STMT_COPY_KEYS_RANGE */ "SELECT key FROM appdata WHERE appId = :app AND key >= :lo AND key < :hi;",
+    /* STMT_COPY_KEYS_FROM */  "SELECT key FROM appdata WHERE appId = :app AND key >= :lo;",
+    /* STMT_COPY_ALL */     "SELECT key,value,type FROM appdata WHERE appId = :app;",
+    /* STMT_COPY_ALL_RANGE */  "SELECT key,value,type FROM appdata WHERE appId = :app AND key >= :lo AND key < :hi;",
+    /* STMT_COPY_ALL_FROM */   "SELECT key,value,type FROM appdata WHERE appId = :app AND key >= :lo;",
+    /* STMT_CAS_UPDATE */   "UPDATE appdata SET value = :value, type = 1, version = version + 1,"
+                            " seq = " SHARED_NEXT_SEQ( ":app" )
+                            " WHERE appId = :app AND key = :key AND version = :version;",
+    /* STMT_CAS_INSERT */   "INSERT OR IGNORE INTO appdata( appId, key, value, type, version, seq )"
+                            " VALUES( :app, :key, :value, 1, 1 + " SHARED_LAST_VERSION ","
+                            " " SHARED_NEXT_SEQ( ":app" ) " );",
+    /* STMT_CHANGED_SINCE */ "SELECT key,value,seq FROM appdata WHERE appId = :app AND seq > :seq ORDER BY seq;",
+    /* STMT_REMOVED_SINCE */ "SELECT key,seq FROM tombstones WHERE appId = :app AND seq > :seq"
+                            " AND key IS NOT NULL ORDER BY seq;",
+    /* STMT_LAST_SEQ */     "SELECT " SHARED_NEXT_SEQ( ":app" ) " - 1;",
+    /* STMT_SEQ_FLOOR */    "SELECT IFNULL( (SELECT MAX(seq) FROM tombstones"
+                            " WHERE appId = :app AND key IS NULL), 0 );",
+    /* STMT_LAST_VERSION */ "SELECT MAX( IFNULL( (SELECT MAX(version) FROM appdata WHERE appId = :app), 0 ),"
+                            " IFNULL( (SELECT MAX(version) FROM tombstones WHERE appId = :app), 0 ) );",
+};
+
 typedef struct LPAppHandle_t {
-    gchar*   pPath;
+    gchar*   appId;
+    gchar*   pPath;             /* the app's own directory */
+    gchar*   pDbPath;           /* the DB we open: the app's own, or shared */
+    bool     shared;
     sqlite3* pDb;
+    bool     inTxn;             /* BEGIN issued and not yet ended */
+    bool     dirty;             /* written to since BEGIN */
+    bool     republish;         /* the first write removed a snapshot */
+    guint    cacheGen;          /* the app's cache generation as of BEGIN */
+    bool     readOnly;          /* from LPAppGetSnapshotHandle() */
+    const guint8* snap;         /* its mapped snapshot, if it got one */
+    gsize    snapSize;
+    LPDurability durability;
+    guint    clearGen;          /* the app's clear generation as of opening */
+    dev_t    dbDev;             /* and the DB file that was opened */
+    ino_t    dbIno;
+    sqlite3_stmt* stmts[STMT_COUNT];
 } LPAppHandle_t;
 
+typedef int (*RowProc)( sqlite3_stmt* stmt, void* context );
+
+/* Iterators get statements of their own, since more than one may be walking
+ * the same handle at a time.  Indexed as runPrefixScan()'s variants are. */
+static const char* g_iter_sql[] = {
+    "SELECT key,value,type,version FROM data ORDER BY key;",
+    "SELECT key,value,type,version FROM data WHERE key >= :lo AND key < :hi ORDER BY key;",
+    "SELECT key,value,type,version FROM data WHERE key >= :lo ORDER BY key;",
+};
+static const char* g_shared_iter_sql[] = {
+    "SELECT key,value,type,version FROM appdata WHERE appId = :app ORDER BY key;",
+    "SELECT key,value,type,version FROM appdata WHERE appId = :app AND key >= :lo AND key < :hi ORDER BY key;",
+    "SELECT key,value,type,version FROM appdata WHERE appId = :app AND key >= :lo ORDER BY key;",
+};
+#define ITER_SQL_FULL  0
+#define ITER_SQL_RANGE 1
+#define ITER_SQL_FROM  2
+
+typedef struct LPAppIterator_t {
+    LPAppHandle_t* handle;
+    sqlite3_stmt*  stmt;
+    gchar*         lo;          /* bound to stmt, so they must outlive it */
+    gchar*         hi;
+    bool           done;        /* stepped past the end, or failed */
+} LPAppIterator_t;
+
+/* What handles are given when they're made.  Any thread may set them, and
+ * the async worker makes handles too, so they're read and written under
+ * the lock. */
+static LPDurability g_defaultDurability = LP_DURABILITY_STRICT;
+static LPStorageMode g_storageMode = LP_STORAGE_AUTO;
+G_LOCK_DEFINE_STATIC( settings );
+
 static LPErr openDB( LPAppHandle_t* handle );
 static LPErr addTable( LPAppHandle_t* handle );
+static int bindText( sqlite3_stmt* stmt, const char* name, const char* text );
 static LPErr LPSystemCopyAllCJ_impl( struct json_object** json,
                                      bool onPublicBus );
 static LPErr LPSystemCopyKeysCJ_impl( struct json_object** json,
@@ -140,6 +337,24 @@ check_is_json( const char* text )
     return isJson;
 }
 
+/* check_is_json() that also gives back the value as json-c prints it, for
+ * storing: json_tokener_parse() lets through trailing garbage and single
+ * quotes, and what's stored is spliced into output as is.  Returns NULL if
+ * text isn't json, else a string the caller must g_free. */
+static gchar*
+normalize_json( const char* text )
+{
+    gchar* normal = NULL;
+    struct json_object* jobj = json_tokener_parse( text );
+    if ( !is_error( jobj ) ) {
+        if ( is_toplevel_json( jobj ) ) {
+            normal = g_strdup( json_object_to_json_string( jobj ) );
+        }
+        json_object_put( jobj );
+    }
+    return normal;
+}
+
 static struct json_object*
 keyValueAsObject( const char* key, const char* value )
 {
@@ -261,235 +476,1853 @@ runSQL( LPAppHandle_t* handle, bool canAddTable,
 static LPErr
 addTable( LPAppHandle_t* handle )
 {
-    LPErr err = runSQL( handle, false, NULL, NULL,
-                        "CREATE TABLE IF NOT EXISTS data( key TEXT PRIMARY KEY, value TEXT );" );
+    LPErr err = runSQL( handle, false, NULL, NULL, "%s",
+                        handle->shared ? SHARED_TABLE_SQL : APP_TABLE_SQL );
+
+    /* A DB cleared before this one may have left its last sequence number
+       and, after it, its largest version */
+    gchar* contents = NULL;
+    gchar* path = g_strdup_printf( "%s/" SEQ_FLOOR_NAME, handle->pPath );
+    if ( LP_ERR_NONE == err && !handle->shared
+         && g_file_get_contents( path, &contents, NULL, NULL ) ) {
+        gchar* end = NULL;
+        gint64 seqFloor = g_ascii_strtoll( contents, &end, 10 );
+        gint64 versionFloor = g_ascii_strtoll( end, NULL, 10 );
+        if ( 0 < seqFloor ) {
+            err = runSQL( handle, false, NULL, NULL,
+                          "INSERT INTO tombstones( key, seq, version )"
+                          " SELECT NULL, %lld, %lld WHERE NOT EXISTS"
+                          " (SELECT 1 FROM tombstones WHERE key IS NULL);",
+                          (long long)seqFloor, (long long)MAX( versionFloor, 0 ) );
+        }
+        g_free( contents );
+    }
+    g_free( path );
     return err;
 }
 
 /*
- * Open the sqlite DB if it isn't already open.  Since there are ways to wind
- * up with a DB file that exists but doesn't have a table, we're prepared to
- * add a table in reponse to errors on read or write.  Thus we don't add one
- * here.
+ * Compile sql against the handle's DB, opening it first if need be.  As with
+ * runSQL(), a failure to compile is taken to mean the table is missing and
+ * we try once more after adding it.
  */
 static LPErr
-openDB( LPAppHandle_t* handle )
+prepareStmt( LPAppHandle_t* handle, const char* sql, sqlite3_stmt** stmtp )
 {
-    LPErr err = LP_ERR_NONE;
-    if ( handle->pDb == NULL ) {
-        if ( handle->pPath == NULL ) {
-            err = LP_ERR_INVALID_HANDLE;
-        } else {
-            g_mkdir_with_parents( handle->pPath, O_RDWR );
-            gchar* fullPath = g_strdup_printf( "%s/prefsDB.sl", handle->pPath );
-
-            sqlite3* pDb;
-            int result = sqlite3_open( fullPath, &pDb );
-            if ( result == 0 ) {
-                handle->pDb = pDb; /* assign this before calling runSQL()!!! */
-
-                err = runSQL( handle, false, NULL, NULL, "BEGIN;" ); /* begin a transaction */
-            } else {
-                err = sqlerr_to_lperr( result );
+    LPErr lperr = openDB( handle );
+    if ( LP_ERR_NONE == lperr ) {
+        bool canAddTable = true;
+        int err;
+    again:
+        err = sqlite3_prepare_v2( handle->pDb, sql, -1, stmtp, NULL );
+        if ( SQLITE_ERROR == err && canAddTable ) {
+            canAddTable = false;
+            if ( LP_ERR_NONE == addTable( handle ) ) {
+                goto again;
             }
-            g_free( fullPath );
         }
+        if ( SQLITE_OK != err ) {
+            fprintf( stderr, "sqlite3_prepare_v2(\"%s\")=>%d/\"%s\"\n",
+                     sql, err, sqlite3_errmsg( handle->pDb ) );
+        }
+        lperr = sqlerr_to_lperr( err );
     }
-    return err;
-} /* openDB */
+    return lperr;
+} /* prepareStmt */
 
-LPErr
-LPAppClearData( const char* appId )
+/*
+ * Return in *stmtp the handle's compiled copy of statement id, compiling it
+ * first if need be, with the handle's appId bound if it's one of the shared
+ * DB's.  The statement belongs to the handle: don't finalize it.
+ */
+static LPErr
+getStmt( LPAppHandle_t* handle, StmtId id, sqlite3_stmt** stmtp )
 {
-    gchar* path = g_strdup_printf( "/var/preferences/%s/prefsDB.sl", appId );
-    int err = unlink( path );
-    g_free( path );
-    return (err == 0)? LP_ERR_NONE : LP_ERR_PARAM_ERR;
+    LPErr lperr = openDB( handle );
+    if ( LP_ERR_NONE == lperr && NULL == handle->stmts[id] ) {
+        const char* sql = handle->shared ? g_shared_stmt_sql[id] : g_stmt_sql[id];
+        lperr = prepareStmt( handle, sql, &handle->stmts[id] );
+    }
+    if ( LP_ERR_NONE == lperr ) {
+        *stmtp = handle->stmts[id];
+        bindText( *stmtp, ":app", handle->appId );
+    }
+    return lperr;
+} /* getStmt */
+
+/* Bind text to a named parameter.  A parameter the statement doesn't use is
+ * not an error.  The text must stay valid until stepStmt() returns. */
+static int
+bindText( sqlite3_stmt* stmt, const char* name, const char* text )
+{
+    int err = SQLITE_OK;
+    int index = sqlite3_bind_parameter_index( stmt, name );
+    if ( 0 < index ) {
+        err = sqlite3_bind_text( stmt, index, text, -1, SQLITE_STATIC );
+    }
+    return err;
 }
 
-LPErr
-LPAppGetHandle( const char* appId, LPAppHandle* handle )
+/* bindText() for 64-bit integers */
+static int
+bindInt64( sqlite3_stmt* stmt, const char* name, gint64 value )
 {
-    g_return_val_if_fail( handle != NULL, -EINVAL );
-    *handle = NULL;
+    int err = SQLITE_OK;
+    int index = sqlite3_bind_parameter_index( stmt, name );
+    if ( 0 < index ) {
+        err = sqlite3_bind_int64( stmt, index, value );
+    }
+    return err;
+}
 
-    g_return_val_if_fail( appId != NULL, -EINVAL );
+/*
+ * Run a statement to completion, handing each row to proc if it's non-NULL.
+ * A non-0 return from proc stops the walk and, as with sqlite3_exec's
+ * callback, is reported as an abort.  The statement is reset and its
+ * bindings cleared on the way out so it's ready for the next caller and
+ * holds no locks.
+ */
+static LPErr
+stepStmt( LPAppHandle_t* handle, sqlite3_stmt* stmt, RowProc proc, void* context )
+{
+    int err;
+    while ( SQLITE_ROW == (err = sqlite3_step( stmt )) ) {
+        if ( NULL != proc && 0 != (*proc)( stmt, context ) ) {
+            err = SQLITE_ABORT;
+            break;
+        }
+    }
 
-    LPAppHandle_t* hndl = g_new0( LPAppHandle_t, 1 );
-    hndl->pPath = g_strdup_printf( "/var/preferences/%s", appId );
+    if ( SQLITE_DONE == err ) {
+        err = SQLITE_OK;
+    } else if ( SQLITE_ABORT != err ) {
+        fprintf( stderr, "sqlite3_step(\"%s\")=>%d/\"%s\"\n",
+                 sqlite3_sql( stmt ), err, sqlite3_errmsg( handle->pDb ) );
+    }
 
-    *handle = (LPAppHandle)hndl;
+    sqlite3_reset( stmt );
+    sqlite3_clear_bindings( stmt );
+    return sqlerr_to_lperr( err );
+} /* stepStmt */
 
-    return 0;
-} /* LPAppGetHandle */
+/* Convenience for the parameterless statements */
+static LPErr
+runStmt( LPAppHandle_t* handle, StmtId id, RowProc proc, void* context )
+{
+    sqlite3_stmt* stmt;
+    LPErr err = getStmt( handle, id, &stmt );
+    if ( LP_ERR_NONE == err ) {
+        err = stepStmt( handle, stmt, proc, context );
+    }
+    return err;
+}
 
-LPErr
-LPAppFreeHandle( LPAppHandle handle, bool commit )
+/*
+ * The smallest string that's greater than every string beginning with
+ * prefix, or NULL if there's no such thing (prefix is all 0xff bytes).  Keys
+ * use sqlite's default BINARY collation, so byte order is what counts.
+ */
+static gchar*
+prefixUpperBound( const char* prefix )
 {
-    LPErr lperr = LP_ERR_NONE;
-    g_return_val_if_fail( handle != NULL, -EINVAL );
-    LPAppHandle_t* hndl = (LPAppHandle_t*)handle;
+    gchar* hi = g_strdup( prefix );
+    int len = strlen( hi );
+    while ( len > 0 && 0xff == (guchar)hi[len-1] ) {
+        --len;
+    }
+    if ( 0 == len ) {
+        g_free( hi );
+        hi = NULL;
+    } else {
+        ++hi[len-1];
+        hi[len] = '\0';
+    }
+    return hi;
+}
 
-    if ( hndl->pDb ) {
-        lperr = runSQL( handle, false, NULL, NULL, "%s;", (commit?"COMMIT":"ROLLBACK") );
-        if ( LP_ERR_NONE == lperr ) {
-            lperr = sqlerr_to_lperr(sqlite3_close( hndl->pDb ) );
-            hndl->pDb = NULL;
+/*
+ * Run one of the key scans over only the keys beginning with prefix.  The
+ * scan is a range [prefix, prefixUpperBound(prefix)) so sqlite can walk just
+ * that part of the primary key's index.  full is used when there's no
+ * prefix, from when the range has no upper end.
+ */
+static LPErr
+runPrefixScan( LPAppHandle_t* handle, const char* prefix,
+               StmtId full, StmtId range, StmtId from,
+               RowProc proc, void* context )
+{
+    LPErr err;
+    if ( NULL == prefix || '\0' == *prefix ) {
+        err = runStmt( handle, full, proc, context );
+    } else {
+        sqlite3_stmt* stmt;
+        gchar* hi = prefixUpperBound( prefix );
+        err = getStmt( handle, NULL != hi ? range : from, &stmt );
+        if ( LP_ERR_NONE == err ) {
+            bindText( stmt, ":lo", prefix );
+            bindText( stmt, ":hi", hi );
+            err = stepStmt( handle, stmt, proc, context );
         }
+        g_free( hi );
     }
-
-    g_free( hndl->pPath );
-    g_free( hndl );
-    return lperr;
-}
+    return err;
+} /* runPrefixScan */
 
 static int
-getValue( void* context, int nColumns, char** colValues, char** colNames )
+getSeq( sqlite3_stmt* stmt, void* context )
 {
-    g_assert( nColumns == 1 );    /* I asked for one column, not '*' */
-    gchar** result = (gchar**)context;
-    *result = g_strdup( colValues[0] );
-    return 0;      /* non-0 return aborts, but causes sqlite3_exec to return
-                      SQLITE_ABORT  */
+    *(gint64*)context = sqlite3_column_int64( stmt, 0 );
+    return 0;
 }
 
-#ifdef USE_MJSON
 static void
-cjson_to_mjson_put( json_t** jsont, struct json_object* json )
+finalizeStmts( LPAppHandle_t* handle )
 {
-    const char* asStr = json_object_get_string( json );
-    *jsont = json_parse_document( asStr );
-    json_object_put( json );
+    int ii;
+    for ( ii = 0; ii < STMT_COUNT; ++ii ) {
+        if ( NULL != handle->stmts[ii] ) {
+            (void)sqlite3_finalize( handle->stmts[ii] );
+            handle->stmts[ii] = NULL;
+        }
+    }
 }
-#endif
 
-#ifdef USE_MJSON
+/*
+ * The value cache.  Optional -- off until LPAppSetCacheBudget() gives it
+ * some room -- and shared by every handle in the process, so it's keyed by
+ * (appId, key).  Only what's been committed goes in: a handle with writes
+ * of its own pending neither reads from nor fills it, and committing those
+ * writes drops everything cached for the app.
+ *
+ * Other processes write to the same DBs, so each time a handle begins a
+ * transaction we stat the DB and its WAL; if either has changed since we
+ * last looked, someone else committed and we drop the app's entries.  In the
+ * shared DB any app's commit changes those, so there we ask for the app's
+ * last sequence number instead, which only its own writes move.
+ * Dropping bumps the app's generation, and a handle whose transaction began
+ * under an older generation may be looking at a snapshot the cache has
+ * moved past (or the other way around): it stays away from the cache until
+ * its next transaction.
+ */
+typedef struct FileStamp {
+    dev_t  dev;
+    ino_t  ino;
+    off_t  size;
+    time_t mtime;
+    long   mtimeNsec;
+} FileStamp;
+
+typedef struct AppCache {
+    GHashTable* entries;        /* key => CacheEntry* */
+    guint       gen;
+    FileStamp   db;
+    FileStamp   wal;
+    gint64      lastSeq;        /* in the shared DB, instead */
+} AppCache;
+
+typedef struct CacheEntry {
+    AppCache* app;
+    gchar*    key;
+    gchar*    value;
+    gint64    version;
+    gsize     size;             /* what we charge it against the budget */
+    GList*    link;             /* in g_cache.lru */
+} CacheEntry;
+
+static struct {
+    GHashTable* apps;           /* appId => AppCache*; never shrinks */
+    GQueue      lru;            /* CacheEntry*, most recently used first */
+    gsize       budget;
+    LPAppCacheStats stats;
+} g_cache = { NULL, G_QUEUE_INIT, 0, };
+G_LOCK_DEFINE_STATIC( cache );
+
 static void
-mjson_to_cjson( struct json_object** json, const json_t* jsont )
+stampFile( const char* path, FileStamp* stamp )
 {
-    char *text = NULL;
-    enum json_error err = json_tree_to_string( (json_t*)jsont, &text );
-    if ( JSON_OK == err )
-    {
-        *json = json_tokener_parse( text );
-        g_free( text );
-    } else {
-        g_assert(0);            /* what to do? */
+    struct stat st;
+    memset( stamp, 0, sizeof(*stamp) );
+    if ( 0 == stat( path, &st ) ) {
+        stamp->dev = st.st_dev;
+        stamp->ino = st.st_ino;
+        stamp->size = st.st_size;
+        stamp->mtime = st.st_mtime;
+        stamp->mtimeNsec = st.st_mtim.tv_nsec;
     }
 }
-#endif
 
-LPErr
-LPAppCopyValue( LPAppHandle handle, const char* key, char** jstr )
+/* A DB and its WAL */
+static void
+stampDB( const char* path, FileStamp* db, FileStamp* wal )
 {
-    g_return_val_if_fail( handle != NULL, -EINVAL );
-    g_return_val_if_fail( key != NULL, -EINVAL );
-    g_return_val_if_fail( jstr != NULL, -EINVAL );
-
-    gchar* value = NULL;
+    stampFile( path, db );
+    gchar* walPath = g_strdup_printf( "%s-wal", path );
+    stampFile( walPath, wal );
+    g_free( walPath );
+}
 
-    LPErr err = runSQL( handle, true, getValue, &value,
-                        "SELECT VALUE FROM data WHERE key = \'%q\';", key );
+static void
+cacheEntryFree( gpointer data )
+{
+    CacheEntry* entry = (CacheEntry*)data;
+    g_queue_delete_link( &g_cache.lru, entry->link );
+    g_cache.stats.bytes -= entry->size;
+    g_free( entry->key );
+    g_free( entry->value );
+    g_free( entry );
+}
 
-    if ( err == 0 ) {
-        if ( !value ) {         /* will be null if getValue() never fired */
-            err = LP_ERR_NO_SUCH_KEY;
-        } else if ( !check_is_json(value) ) {
-            g_critical( "non-json value stored: %s", value );
-            err = LP_ERR_VALUENOTJSON;
-        } else {
-            *jstr = value;
-            value = NULL;
+/* Must hold the lock.  Returns NULL if the cache is off. */
+static AppCache*
+cacheGetApp( const char* appId )
+{
+    AppCache* app = NULL;
+    if ( 0 < g_cache.budget ) {
+        if ( NULL == g_cache.apps ) {
+            g_cache.apps = g_hash_table_new( g_str_hash, g_str_equal );
+        }
+        app = g_hash_table_lookup( g_cache.apps, appId );
+        if ( NULL == app ) {
+            app = g_new0( AppCache, 1 );
+            app->entries = g_hash_table_new_full( g_str_hash, g_str_equal,
+                                                  NULL, cacheEntryFree );
+            g_hash_table_insert( g_cache.apps, g_strdup( appId ), app );
         }
     }
+    return app;
+}
 
-    g_free( (gchar*)value );
-    return err;
+/* Must hold the lock */
+static void
+cacheDropApp( AppCache* app )
+{
+    if ( 0 < g_hash_table_size( app->entries ) ) {
+        g_hash_table_remove_all( app->entries );
+        ++g_cache.stats.invalidations;
+    }
+    ++app->gen;
 }
 
-LPErr
-LPAppCopyValueString( LPAppHandle handle, const char* key, char** str )
+/* Must hold the lock */
+static void
+cacheTrim( gsize budget )
 {
-    struct json_object* json;
-    LPErr err = LPAppCopyValueCJ( handle, key, &json );
-    if ( LP_ERR_NONE == err && json_object_is_type( json, json_type_array ) )
-    {
-        /* assume it's an array of length one.  Return the string at elem 0. */
-        struct json_object* child = json_object_array_get_idx( json, 0 );
+    CacheEntry* entry;
+    while ( g_cache.stats.bytes > budget
+            && NULL != (entry = g_queue_peek_tail( &g_cache.lru )) ) {
+        g_hash_table_remove( entry->app->entries, entry->key );
+        ++g_cache.stats.evictions;
+    }
+}
 
-        if ( (NULL != child) && ( json_object_is_type( child, json_type_string)) )
-        {
-            *str = g_strdup( json_object_get_string( child ) );
+/*
+ * Called once the handle has begun a transaction: notice changes made by
+ * anyone else, and note the generation the transaction starts under.
+ */
+static void
+cacheBeginTxn( LPAppHandle_t* handle )
+{
+    FileStamp db, wal;
+    gint64 lastSeq = 0;
+    memset( &db, 0, sizeof(db) );
+    memset( &wal, 0, sizeof(wal) );
+
+    G_LOCK( cache );
+    bool on = 0 < g_cache.budget;
+    G_UNLOCK( cache );
+
+    if ( !on ) {
+        /* nothing to check */
+    } else if ( handle->shared ) {
+        /* read in the transaction, so it's the snapshot's own */
+        sqlite3_stmt* stmt;
+        if ( LP_ERR_NONE != getStmt( handle, STMT_LAST_SEQ, &stmt )
+             || LP_ERR_NONE != stepStmt( handle, stmt, getSeq, &lastSeq ) ) {
+            lastSeq = -1;       /* can't tell: assume the worst */
         }
-        else
-        {
-            err = LP_ERR_VALUENOTJSON;
+    } else {
+        stampDB( handle->pDbPath, &db, &wal );
+    }
+
+    G_LOCK( cache );
+    AppCache* app = cacheGetApp( handle->appId );
+    if ( NULL != app ) {
+        if ( memcmp( &db, &app->db, sizeof(db) )
+             || memcmp( &wal, &app->wal, sizeof(wal) )
+             || lastSeq != app->lastSeq || 0 > lastSeq ) {
+            cacheDropApp( app );
+            app->db = db;
+            app->wal = wal;
+            app->lastSeq = lastSeq;
         }
-        json_object_put( json );
+        handle->cacheGen = app->gen;
     }
-    return err;
+    G_UNLOCK( cache );
 }
 
-LPErr
-LPAppCopyValueInt( LPAppHandle handle, const char* key, int* intValue )
+/* Called once a transaction has ended; committed says whether it wrote. */
+static void
+cacheEndTxn( LPAppHandle_t* handle, bool committed )
 {
-    struct json_object* json;
-    LPErr err = LPAppCopyValueCJ( handle, key, &json );
-    if ( LP_ERR_NONE == err )
-    {
-        /* assume it's an array of length one.  Return the string at elem 0. */
-        struct json_object* child = json_object_array_get_idx( json, 0 );
-        if ( (NULL != child) && json_object_is_type( child, json_type_string) )
-        {
-            *intValue = atoi( json_object_get_string( child ) );
+    if ( committed && handle->dirty ) {
+        G_LOCK( cache );
+        AppCache* app = cacheGetApp( handle->appId );
+        if ( NULL != app ) {
+            cacheDropApp( app );
         }
-        else
-        {
-            err = LP_ERR_VALUENOTJSON;
+        G_UNLOCK( cache );
+    }
+    handle->dirty = false;
+}
+
+/* Must hold the lock.  The app's entries, if this handle may use them. */
+static AppCache*
+cacheForHandle( LPAppHandle_t* handle )
+{
+    AppCache* app = NULL;
+    if ( handle->inTxn && !handle->dirty ) {
+        app = cacheGetApp( handle->appId );
+        if ( NULL != app && app->gen != handle->cacheGen ) {
+            app = NULL;
         }
-        json_object_put( json );
     }
+    return app;
+}
 
-    return err;
+/* g_strdup of the cached value for key, or NULL; its version in *version */
+static gchar*
+cacheLookup( LPAppHandle_t* handle, const char* key, gint64* version )
+{
+    gchar* value = NULL;
+    G_LOCK( cache );
+    AppCache* app = cacheForHandle( handle );
+    if ( NULL != app ) {
+        CacheEntry* entry = g_hash_table_lookup( app->entries, key );
+        if ( NULL != entry ) {
+            g_queue_unlink( &g_cache.lru, entry->link );
+            g_queue_push_head_link( &g_cache.lru, entry->link );
+            value = g_strdup( entry->value );
+            *version = entry->version;
+            ++g_cache.stats.hits;
+        } else {
+            ++g_cache.stats.misses;
+        }
+    }
+    G_UNLOCK( cache );
+    return value;
 }
 
-#ifdef USE_MJSON
-LPErr
-LPAppCopyValueJ( LPAppHandle handle, const char* key, json_t** jsont )
+/* Remember a value the handle just read, known to be json */
+static void
+cacheStore( LPAppHandle_t* handle, const char* key, const char* value,
+            gint64 version )
 {
-    LPErr err;
-    struct json_object* json;
-    err = LPAppCopyValueCJ( handle, key, &json );
-    if ( LP_ERR_NONE == err ) {
-        cjson_to_mjson_put( jsont, json );
+    G_LOCK( cache );
+    AppCache* app = cacheForHandle( handle );
+    if ( NULL != app ) {
+        gsize size = sizeof(CacheEntry) + strlen( key ) + strlen( value ) + 2;
+        if ( size <= g_cache.budget ) {
+            CacheEntry* entry = g_new( CacheEntry, 1 );
+            entry->app = app;
+            entry->key = g_strdup( key );
+            entry->value = g_strdup( value );
+            entry->version = version;
+            entry->size = size;
+            g_queue_push_head( &g_cache.lru, entry );
+            entry->link = g_queue_peek_head_link( &g_cache.lru );
+            g_cache.stats.bytes += size;
+            g_hash_table_replace( app->entries, entry->key, entry );
+            cacheTrim( g_cache.budget );
+        }
     }
-    return err;
+    G_UNLOCK( cache );
 }
-#endif
 
-LPErr
-LPAppCopyValueCJ( LPAppHandle handle, const char* key, struct json_object** json )
+/* For when the DB goes away out from under us */
+static void
+cacheForgetApp( const char* appId )
 {
-    g_return_val_if_fail( handle != NULL, -EINVAL );
-    g_return_val_if_fail( key != NULL, -EINVAL );
-    g_return_val_if_fail( json != NULL, -EINVAL );
+    G_LOCK( cache );
+    AppCache* app = NULL == g_cache.apps ? NULL
+        : g_hash_table_lookup( g_cache.apps, appId );
+    if ( NULL != app ) {
+        cacheDropApp( app );
+    }
+    G_UNLOCK( cache );
+}
 
-    char* jstr = NULL;
-    LPErr err = LPAppCopyValue( handle, key, &jstr );
+/*
+ * Clear generations.  LPAppClearData() bumps the app's, so a handle opened
+ * before the clear (see LPAppHandleIsStale()) knows it's looking at a DB
+ * that's gone even if a new file has since turned up with the old inode.
+ */
+static GHashTable* g_clearGens = NULL;  /* appId => GUINT_TO_POINTER(gen) */
+G_LOCK_DEFINE_STATIC( clearGens );
 
-    if ( LP_ERR_NONE == err )
-    {
-        err = strToJsonWithCheck( jstr, json );
+static guint
+clearGenFor( const char* appId, bool bump )
+{
+    G_LOCK( clearGens );
+    if ( NULL == g_clearGens ) {
+        g_clearGens = g_hash_table_new_full( g_str_hash, g_str_equal,
+                                             g_free, NULL );
     }
-
-    g_free( jstr );
-    return err;
+    guint gen = GPOINTER_TO_UINT( g_hash_table_lookup( g_clearGens, appId ) );
+    if ( bump ) {
+        g_hash_table_replace( g_clearGens, g_strdup( appId ),
+                              GUINT_TO_POINTER( ++gen ) );
+    }
+    G_UNLOCK( clearGens );
+    return gen;
 }
 
+/*
+ * Set up the connection for the handle's durability profile.  Has to happen
+ * outside of a transaction.  STRICT leaves the journal mode alone: a DB
+ * someone else has put in WAL mode stays that way rather than flip-flopping,
+ * and synchronous=FULL makes WAL commits as durable as the rollback journal.
+ * Failing to switch to WAL (the DB is busy, say) isn't fatal; we'll just be
+ * slower.
+ */
 static LPErr
-copy_as_string( struct json_object* json, char** out )
+applyDurability( LPAppHandle_t* handle )
 {
-    LPErr err = LP_ERR_NONE;
+    const char* sql = (LP_DURABILITY_WAL == handle->durability)
+        ? "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;"
+        : "PRAGMA synchronous=FULL;";
+
+    char* errmsg = NULL;
+    int err = sqlite3_exec( handle->pDb, sql, NULL, NULL, &errmsg );
+    if ( SQLITE_OK != err ) {
+        fprintf( stderr, "sqlite3_exec(\"%s\")=>%d/\"%s\"\n", sql, err,
+                 NULL != errmsg ? errmsg : "" );
+        sqlite3_free( errmsg );
+    }
+    return LP_ERR_NONE;
+}
+
+/* Run sql, which must return a single integer, putting the result in *result */
+static int
+queryInt( sqlite3* db, const char* sql, int* result )
+{
+    sqlite3_stmt* stmt;
+    int err = sqlite3_prepare_v2( db, sql, -1, &stmt, NULL );
+    if ( SQLITE_OK == err ) {
+        *result = 0;
+        err = sqlite3_step( stmt );
+        if ( SQLITE_ROW == err ) {
+            *result = sqlite3_column_int( stmt, 0 );
+        }
+        err = sqlite3_finalize( stmt );
+    }
+    return err;
+}
+
+/* As queryInt(), for results that may not fit in an int */
+static int
+queryInt64( sqlite3* db, const char* sql, gint64* result )
+{
+    sqlite3_stmt* stmt;
+    int err = sqlite3_prepare_v2( db, sql, -1, &stmt, NULL );
+    if ( SQLITE_OK == err ) {
+        *result = 0;
+        err = sqlite3_step( stmt );
+        if ( SQLITE_ROW == err ) {
+            *result = sqlite3_column_int64( stmt, 0 );
+        }
+        err = sqlite3_finalize( stmt );
+    }
+    return err;
+}
+
+/* lp_is_json( text ): check_is_json() for use in the migration's SQL */
+static void
+isJsonFunc( sqlite3_context* ctx, int argc, sqlite3_value** argv )
+{
+    const char* text = (const char*)sqlite3_value_text( argv[0] );
+    sqlite3_result_int( ctx, NULL != text && check_is_json( text ) );
+}
+
+/* lp_json( text ): normalize_json(), or NULL, for the same */
+static void
+jsonFunc( sqlite3_context* ctx, int argc, sqlite3_value** argv )
+{
+    const char* text = (const char*)sqlite3_value_text( argv[0] );
+    gchar* normal = NULL == text ? NULL : normalize_json( text );
+    if ( NULL == normal ) {
+        sqlite3_result_null( ctx );
+    } else {
+        sqlite3_result_text( ctx, normal, -1, g_free );
+    }
+}
+
+/* Whether the DB has a table called name */
+static int
+hasTable( sqlite3* db, const char* name, int* exists )
+{
+    char* sql = sqlite3_mprintf( "SELECT count(*) FROM sqlite_master"
+                                 " WHERE type = 'table' AND name = %Q;", name );
+    int err = queryInt( db, sql, exists );
+    sqlite3_free( sql );
+    return err;
+}
+
+/*
+ * Bring a DB written by an older version of this library up to
+ * SCHEMA_VERSION.  Version 0 predates data.type: add the column and, since
+ * this happens once per DB, pay for checking every existing value now so
+ * reads never have to.  Version 1 predates the version column; what's there
+ * already starts at 1, since 0 is how LPAppCompareAndSetValue() spells "not
+ * there".  Version 2 predates the change journal; the rows there are
+ * numbered in the order they were added, and there's nothing to say what
+ * was removed before.  Version 3's tombstones predate their version
+ * column, so keys removed before come back at 1.  Before version 5 values
+ * were stored as given rather than as json-c prints them; they're printed
+ * afresh.  A DB without a table yet just gets stamped, and
+ * addTable() creates the current schema.
+ *
+ * This runs in a transaction of its own, committed before openDB() begins
+ * the handle's, and takes the write lock up front so two processes opening
+ * the same DB don't both try.
+ */
+static LPErr
+migrateSchema( LPAppHandle_t* handle )
+{
+    sqlite3* db = handle->pDb;
+    int version = 0;
+    int err = queryInt( db, "PRAGMA user_version;", &version );
+    if ( SQLITE_OK == err && version < SCHEMA_VERSION ) {
+        err = sqlite3_exec( db, "BEGIN IMMEDIATE;", NULL, NULL, NULL );
+        if ( SQLITE_OK == err ) {
+            /* someone may have beaten us to it */
+            err = queryInt( db, "PRAGMA user_version;", &version );
+
+            if ( SQLITE_OK == err && version < 1 ) {
+                int exists = 0;
+                err = hasTable( db, "data", &exists );
+                if ( SQLITE_OK == err && exists ) {
+                    err = sqlite3_create_function( db, "lp_is_json", 1,
+                                                   SQLITE_UTF8, NULL,
+                                                   isJsonFunc, NULL, NULL );
+                }
+                if ( SQLITE_OK == err && exists ) {
+                    err = sqlite3_exec( db, "ALTER TABLE data ADD COLUMN"
+                                        " type INTEGER NOT NULL DEFAULT 0;"
+                                        " UPDATE data SET type = 1"
+                                        " WHERE lp_is_json( value );",
+                                        NULL, NULL, NULL );
+                }
+            }
+
+            if ( SQLITE_OK == err && version < 2 ) {
+                const char* tables[] = { "data", "appdata" };
+                unsigned int ii;
+                for ( ii = 0; SQLITE_OK == err && ii < G_N_ELEMENTS(tables); ++ii ) {
+                    int exists = 0;
+                    err = hasTable( db, tables[ii], &exists );
+                    if ( SQLITE_OK == err && exists ) {
+                        char* sql = sqlite3_mprintf( "ALTER TABLE %s ADD COLUMN"
+                                                     " version INTEGER NOT NULL DEFAULT 0;"
+                                                     " UPDATE %s SET version = 1;",
+                                                     tables[ii], tables[ii] );
+                        err = sqlite3_exec( db, sql, NULL, NULL, NULL );
+                        sqlite3_free( sql );
+                    }
+                }
+            }
+
+            if ( SQLITE_OK == err && version < 3 ) {
+                const char* tables[] = { "data", "appdata" };
+                const char* journals[] = { APP_JOURNAL_SQL, SHARED_JOURNAL_SQL };
+                unsigned int ii;
+                for ( ii = 0; SQLITE_OK == err && ii < G_N_ELEMENTS(tables); ++ii ) {
+                    int exists = 0;
+                    err = hasTable( db, tables[ii], &exists );
+                    if ( SQLITE_OK == err && exists ) {
+                        char* sql = sqlite3_mprintf( "ALTER TABLE %s ADD COLUMN"
+                                                     " seq INTEGER NOT NULL DEFAULT 0;"
+                                                     " UPDATE %s SET seq = rowid;",
+                                                     tables[ii], tables[ii] );
+                        err = sqlite3_exec( db, sql, NULL, NULL, NULL );
+                        sqlite3_free( sql );
+                    }
+                    if ( SQLITE_OK == err && exists ) {
+                        err = sqlite3_exec( db, journals[ii], NULL, NULL, NULL );
+                    }
+                }
+            }
+
+            if ( SQLITE_OK == err && 3 == version ) {
+                /* the step above makes version 3's tombstones as they are
+                   now; only ones made by it need the column and the
+                   trigger that fills it */
+                const char* tables[] = { "data", "appdata" };
+                const char* journals[] = { APP_JOURNAL_SQL, SHARED_JOURNAL_SQL };
+                unsigned int ii;
+                for ( ii = 0; SQLITE_OK == err && ii < G_N_ELEMENTS(tables); ++ii ) {
+                    int exists = 0;
+                    err = hasTable( db, tables[ii], &exists );
+                    if ( SQLITE_OK == err && exists ) {
+                        char* sql = sqlite3_mprintf( "ALTER TABLE tombstones ADD COLUMN"
+                                                     " version INTEGER NOT NULL DEFAULT 0;"
+                                                     " DROP TRIGGER IF EXISTS %s_bury; %s",
+                                                     tables[ii], journals[ii] );
+                        err = sqlite3_exec( db, sql, NULL, NULL, NULL );
+                        sqlite3_free( sql );
+                    }
+                }
+            }
+
+            if ( SQLITE_OK == err && version < 5 ) {
+                const char* tables[] = { "data", "appdata" };
+                unsigned int ii;
+                err = sqlite3_create_function( db, "lp_json", 1, SQLITE_UTF8,
+                                               NULL, jsonFunc, NULL, NULL );
+                for ( ii = 0; SQLITE_OK == err && ii < G_N_ELEMENTS(tables); ++ii ) {
+                    int exists = 0;
+                    err = hasTable( db, tables[ii], &exists );
+                    if ( SQLITE_OK == err && exists ) {
+                        char* sql = sqlite3_mprintf( "UPDATE %s SET value ="
+                                                     " IFNULL( lp_json( value ), value )"
+                                                     " WHERE type = 1;", tables[ii] );
+                        err = sqlite3_exec( db, sql, NULL, NULL, NULL );
+                        sqlite3_free( sql );
+                    }
+                }
+            }
+
+            if ( SQLITE_OK == err ) {
+                err = sqlite3_exec( db, "PRAGMA user_version = "
+                                    G_STRINGIFY(SCHEMA_VERSION) ";"
+                                    " COMMIT;", NULL, NULL, NULL );
+            }
+            if ( SQLITE_OK != err ) {
+                fprintf( stderr, "%s: migrating %s from version %d=>%d/\"%s\"\n",
+                         __func__, handle->pDbPath, version, err,
+                         sqlite3_errmsg( db ) );
+                (void)sqlite3_exec( db, "ROLLBACK;", NULL, NULL, NULL );
+            }
+        }
+    }
+    return sqlerr_to_lperr( err );
+} /* migrateSchema */
+
+/* Apps in the shared DB may have no directory of their own, and publishing
+ * shouldn't make them one, so theirs sit beside the DB */
+static gchar*
+snapshotPath( const char* appId, bool shared )
+{
+    return g_strdup_printf( shared ? APP_PREFS_DIR "/%s." SNAPSHOT_NAME
+                            : APP_PREFS_DIR "/%s/" SNAPSHOT_NAME, appId );
+}
+
+/* Delete a DB and whatever sqlite keeps beside it, so a DB made later at
+ * the same path can't pick up an old WAL or journal.  Returns what
+ * unlink() of the DB itself did. */
+static int
+unlinkDB( const char* path )
+{
+    const char* suffixes[] = { "-wal", "-shm", "-journal" };
+    unsigned int ii;
+    int result = unlink( path );
+    for ( ii = 0; ii < G_N_ELEMENTS(suffixes); ++ii ) {
+        gchar* file = g_strdup_printf( "%s%s", path, suffixes[ii] );
+        (void)unlink( file );
+        g_free( file );
+    }
+    return result;
+}
+
+/*
+ * Move whatever the app has in a DB of its own into the shared DB, then
+ * delete its DB.  That happens the first time the app is opened after the
+ * switch to shared storage, in a transaction of its own and before
+ * openDB() begins the handle's.  Should we die between the commit and the
+ * unlink() we'll just do it again: nothing is overwritten.  A version 0 DB
+ * has no type column, so its values come across unchecked; before version 2
+ * there's no version column either, and they come across at version 1, as
+ * migrateSchema() would have left them.  Rows are numbered afresh in the
+ * shared DB's change journal, after anything the app already has there, and
+ * the app's tombstones follow them, floor included.
+ */
+static LPErr
+importAppDB( LPAppHandle_t* handle )
+{
+    int err = SQLITE_OK;
+    gchar* path = g_strdup_printf( "%s/" APP_DB_NAME, handle->pPath );
+    if ( g_file_test( path, G_FILE_TEST_EXISTS ) ) {
+        sqlite3* db = handle->pDb;
+        char* sql = sqlite3_mprintf( "ATTACH %Q AS app;", path );
+        err = sqlite3_exec( db, sql, NULL, NULL, NULL );
+        sqlite3_free( sql );
+
+        if ( SQLITE_OK == err ) {
+            int hasTable = 0;
+            int version = 0;
+            gint64 seq = 0;
+            err = sqlite3_exec( db, "BEGIN IMMEDIATE;", NULL, NULL, NULL );
+            if ( SQLITE_OK == err ) {
+                err = queryInt( db, "SELECT count(*) FROM app.sqlite_master"
+                                " WHERE type = 'table' AND name = 'data';",
+                                &hasTable );
+            }
+            if ( SQLITE_OK == err && hasTable ) {
+                err = queryInt( db, "PRAGMA app.user_version;", &version );
+            }
+            if ( SQLITE_OK == err && hasTable ) {
+                /* the shared DB may be brand new */
+                err = sqlite3_exec( db, SHARED_TABLE_SQL, NULL, NULL, NULL );
+            }
+            if ( SQLITE_OK == err && hasTable ) {
+                sql = sqlite3_mprintf( "SELECT " SHARED_NEXT_SEQ( "%Q" ) " - 1;",
+                                       handle->appId, handle->appId );
+                err = queryInt64( db, sql, &seq );
+                sqlite3_free( sql );
+            }
+            if ( SQLITE_OK == err && hasTable && 2 < version ) {
+                /* carry on from the app's own numbering, so no one holding
+                   a number from it misses what's imported */
+                gint64 appSeq = 0;
+                err = queryInt64( db, "SELECT MAX( IFNULL( (SELECT MAX(seq) FROM app.data), 0 ),"
+                                  " IFNULL( (SELECT MAX(seq) FROM app.tombstones), 0 ) );",
+                                  &appSeq );
+                seq = MAX( seq, appSeq );
+            }
+            if ( SQLITE_OK == err && hasTable ) {
+                sql = sqlite3_mprintf( "INSERT OR IGNORE INTO appdata( appId, key, value, type, version, seq )"
+                                       " SELECT %Q, key, value, %s, %s, %lld + rowid FROM app.data;",
+                                       handle->appId, 0 < version ? "type" : "0",
+                                       1 < version ? "version" : "1", (long long)seq );
+                err = sqlite3_exec( db, sql, NULL, NULL, NULL );
+                sqlite3_free( sql );
+            }
+            if ( SQLITE_OK == err && hasTable && 2 < version ) {
+                /* and what it removed, numbered after the rows, so no one
+                   misses a removal either; the floor keeps its number */
+                gint64 rows = 0;
+                err = queryInt64( db, "SELECT IFNULL( MAX(rowid), 0 ) FROM app.data;",
+                                  &rows );
+                if ( SQLITE_OK == err ) {
+                    sql = sqlite3_mprintf( "INSERT OR IGNORE INTO tombstones( appId, key, seq, version )"
+                                           " SELECT %Q, key, CASE WHEN key IS NULL THEN seq"
+                                           " ELSE %lld + rowid END, %s FROM app.tombstones;",
+                                           handle->appId, (long long)(seq + rows),
+                                           3 < version ? "version" : "0" );
+                    err = sqlite3_exec( db, sql, NULL, NULL, NULL );
+                    sqlite3_free( sql );
+                }
+            }
+            if ( SQLITE_OK == err ) {
+                err = sqlite3_exec( db, "COMMIT;", NULL, NULL, NULL );
+            }
+            if ( SQLITE_OK != err ) {
+                fprintf( stderr, "%s: importing %s=>%d/\"%s\"\n", __func__,
+                         path, err, sqlite3_errmsg( db ) );
+                (void)sqlite3_exec( db, "ROLLBACK;", NULL, NULL, NULL );
+            }
+            (void)sqlite3_exec( db, "DETACH app;", NULL, NULL, NULL );
+        }
+
+        if ( SQLITE_OK == err ) {
+            /* neither snapshot is of what's in the shared DB now */
+            gchar* snap = snapshotPath( handle->appId, false );
+            (void)unlink( snap );
+            g_free( snap );
+            snap = snapshotPath( handle->appId, true );
+            (void)unlink( snap );
+            g_free( snap );
+
+            (void)unlinkDB( path );
+            (void)rmdir( handle->pPath ); /* fails if there's anything else */
+        }
+    }
+    g_free( path );
+    return sqlerr_to_lperr( err );
+} /* importAppDB */
+
+/*
+ * Open the sqlite DB if it isn't already open.  Since there are ways to wind
+ * up with a DB file that exists but doesn't have a table, we're prepared to
+ * add a table in reponse to errors on read or write.  Thus we don't add one
+ * here.
+ */
+static LPErr
+openConnection( LPAppHandle_t* handle )
+{
+    LPErr err = LP_ERR_NONE;
+    if ( handle->pDb == NULL ) {
+        if ( handle->pDbPath == NULL ) {
+            err = LP_ERR_INVALID_HANDLE;
+        } else {
+            gchar* dir = g_path_get_dirname( handle->pDbPath );
+            g_mkdir_with_parents( dir, 0755 );
+            g_free( dir );
+
+            sqlite3* pDb;
+            handle->clearGen = clearGenFor( handle->appId, false );
+            int result = sqlite3_open( handle->pDbPath, &pDb );
+            if ( result == 0 ) {
+                struct stat st;
+                handle->pDb = pDb; /* assign this before calling runSQL()!!! */
+                if ( 0 == stat( handle->pDbPath, &st ) ) {
+                    handle->dbDev = st.st_dev;
+                    handle->dbIno = st.st_ino;
+                }
+                /* Only takes on a DB with no tables yet, so only new DBs get
+                   it; LPAppMaintain() then gives back what removals free.
+                   Has to come before anything writes the DB, WAL included. */
+                (void)sqlite3_exec( pDb, "PRAGMA auto_vacuum = INCREMENTAL;",
+                                    NULL, NULL, NULL );
+                err = applyDurability( handle );
+                if ( LP_ERR_NONE == err ) {
+                    err = migrateSchema( handle );
+                }
+                if ( LP_ERR_NONE == err && handle->shared ) {
+                    err = importAppDB( handle );
+                }
+                if ( LP_ERR_NONE != err ) {
+                    /* don't leave it open: the next call must try again */
+                    (void)sqlite3_close( pDb );
+                    handle->pDb = NULL;
+                }
+            } else {
+                err = sqlerr_to_lperr( result );
+            }
+        }
+    }
+    return err;
+} /* openConnection */
+
+/* Open the DB if need be, and begin a transaction if one isn't under way */
+static LPErr
+openDB( LPAppHandle_t* handle )
+{
+    LPErr err = openConnection( handle );
+    if ( LP_ERR_NONE == err && !handle->inTxn ) {
+        handle->inTxn = true;   /* set this before calling runSQL()!!! */
+        err = runSQL( handle, false, NULL, NULL, "BEGIN;" ); /* begin a transaction */
+        if ( LP_ERR_NONE != err ) {
+            handle->inTxn = false;
+        } else {
+            cacheBeginTxn( handle );
+        }
+    }
+    return err;
+} /* openDB */
+
+/*
+ * Snapshots.  An app's snapshot is a read-only copy of its committed values
+ * laid out for reading in place, so a handle from LPAppGetSnapshotHandle()
+ * can mmap() it once and answer LPAppCopyValue and LPAppCopyKeys with no
+ * sqlite, no locks and no further syscalls.  The file is:
+ *
+ *   SnapHeader
+ *   SnapEntry[count], sorted by key as sqlite sorts them (strcmp order)
+ *   the keys and values, each NUL-terminated
+ *
+ * with offsets from the start of the file.  Snapshots are only kept for apps
+ * someone has asked for one for.  The first write to such an app removes
+ * its snapshot (with the DB's write lock held, so no reader maps one that's
+ * about to go stale) and the writer publishes a new one when its
+ * transaction ends.  Publishing happens under the write lock too, so two
+ * writers can't install theirs out of order.  A snapshot that's missing --
+ * the writer died before publishing, say -- is published by the next
+ * reader to want it.
+ */
+#define SNAPSHOT_MAGIC "LPSNAP2"        /* with its NUL, 8 bytes */
+#define SNAP_NOT_JSON  0x01             /* SnapEntry.flags */
+
+typedef struct SnapHeader {
+    char    magic[8];
+    guint32 count;
+    guint32 size;                       /* of the whole file */
+} SnapHeader;
+
+typedef struct SnapEntry {
+    guint32 key;
+    guint32 value;
+    guint32 valueLen;
+    guint32 flags;
+    gint64  version;
+} SnapEntry;
+
+typedef struct SnapRow {
+    gchar*  key;
+    gchar*  value;
+    guint32 flags;
+    gint64  version;
+} SnapRow;
+
+static void
+snapRowFree( gpointer data )
+{
+    SnapRow* row = (SnapRow*)data;
+    g_free( row->key );
+    g_free( row->value );
+    g_free( row );
+}
+
+static int
+addSnapRow( sqlite3_stmt* stmt, void* context )
+{
+    SnapRow* row = g_new( SnapRow, 1 );
+    row->key = g_strdup( (const char*)sqlite3_column_text( stmt, 0 ) );
+    row->value = g_strdup( (const char*)sqlite3_column_text( stmt, 1 ) );
+    row->flags = ( VALUE_JSON == sqlite3_column_int( stmt, 2 )
+                   || check_is_json( row->value ) ) ? 0 : SNAP_NOT_JSON;
+    row->version = sqlite3_column_int64( stmt, 3 );
+    g_ptr_array_add( (GPtrArray*)context, row );
+    return 0;
+}
+
+/* Write rows to path as a snapshot, by way of a temporary file and rename() */
+static LPErr
+writeSnapshot( LPAppHandle_t* handle, const char* path, GPtrArray* rows )
+{
+    LPErr err = LP_ERR_NONE;
+    guint32 count = rows->len;
+    gsize size = sizeof(SnapHeader) + count * sizeof(SnapEntry);
+    guint ii;
+
+    for ( ii = 0; ii < count; ++ii ) {
+        SnapRow* row = g_ptr_array_index( rows, ii );
+        size += strlen( row->key ) + 1 + strlen( row->value ) + 1;
+    }
+    if ( size > G_MAXUINT32 ) {
+        return LP_ERR_MEM;
+    }
+
+    guint8* buf = g_malloc0( size );
+    SnapHeader* header = (SnapHeader*)buf;
+    SnapEntry* entries = (SnapEntry*)(header + 1);
+    guint32 offset = sizeof(SnapHeader) + count * sizeof(SnapEntry);
+
+    memcpy( header->magic, SNAPSHOT_MAGIC, sizeof(header->magic) );
+    header->count = count;
+    header->size = size;
+    for ( ii = 0; ii < count; ++ii ) {
+        SnapRow* row = g_ptr_array_index( rows, ii );
+        gsize len = strlen( row->key ) + 1;
+        entries[ii].key = offset;
+        memcpy( buf + offset, row->key, len );
+        offset += len;
+
+        len = strlen( row->value );
+        entries[ii].value = offset;
+        entries[ii].valueLen = len;
+        entries[ii].flags = row->flags;
+        entries[ii].version = row->version;
+        memcpy( buf + offset, row->value, len + 1 );
+        offset += len + 1;
+    }
+    g_assert( offset == size );
+
+    gchar* dir = g_path_get_dirname( path );
+    g_mkdir_with_parents( dir, 0755 );
+    g_free( dir );
+
+    gchar* tmpPath = g_strdup_printf( "%s.%d", path, getpid() );
+    int fd = open( tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if ( fd < 0 ) {
+        err = LP_ERR_SYSCONFIG;
+    } else {
+        gsize done = 0;
+        while ( done < size ) {
+            ssize_t nWritten = write( fd, buf + done, size - done );
+            if ( nWritten < 0 && EINTR == errno ) {
+                continue;
+            } else if ( nWritten <= 0 ) {
+                err = LP_ERR_SYSCONFIG;
+                break;
+            }
+            done += nWritten;
+        }
+        /* A torn snapshot is caught when it's mapped, but a strict handle
+           shouldn't leave even that behind */
+        if ( LP_ERR_NONE == err && LP_DURABILITY_STRICT == handle->durability
+             && 0 != fdatasync( fd ) ) {
+            err = LP_ERR_SYSCONFIG;
+        }
+        if ( 0 != close( fd ) && LP_ERR_NONE == err ) {
+            err = LP_ERR_SYSCONFIG;
+        }
+        if ( LP_ERR_NONE == err && 0 != rename( tmpPath, path ) ) {
+            err = LP_ERR_SYSCONFIG;
+        }
+        if ( LP_ERR_NONE != err ) {
+            g_warning( "%s: unable to write %s: %s", __func__, path,
+                       strerror( errno ) );
+            (void)unlink( tmpPath );
+        }
+    }
+    g_free( tmpPath );
+    g_free( buf );
+    return err;
+} /* writeSnapshot */
+
+/*
+ * Write a fresh snapshot of what's committed for the app.  Takes the DB's
+ * write lock for the duration, but writes nothing to the DB.  The handle
+ * must not be in a transaction.
+ */
+static LPErr
+publishSnapshot( LPAppHandle_t* handle )
+{
+    g_assert( !handle->inTxn );
+    LPErr err = openConnection( handle );
+    if ( LP_ERR_NONE == err ) {
+        err = sqlerr_to_lperr( sqlite3_exec( handle->pDb, "BEGIN IMMEDIATE;",
+                                             NULL, NULL, NULL ) );
+    }
+    if ( LP_ERR_NONE == err ) {
+        sqlite3_stmt* stmt = NULL;
+        GPtrArray* rows = g_ptr_array_new_with_free_func( snapRowFree );
+
+        handle->inTxn = true;   /* keep prepareStmt() from beginning another */
+        err = prepareStmt( handle, handle->shared ? g_shared_iter_sql[ITER_SQL_FULL]
+                                                  : g_iter_sql[ITER_SQL_FULL], &stmt );
+        if ( LP_ERR_NONE == err ) {
+            bindText( stmt, ":app", handle->appId );
+            err = stepStmt( handle, stmt, addSnapRow, rows );
+            (void)sqlite3_finalize( stmt );
+        }
+        if ( LP_ERR_NONE == err ) {
+            gchar* path = snapshotPath( handle->appId, handle->shared );
+            err = writeSnapshot( handle, path, rows );
+            g_free( path );
+        }
+
+        /* nothing to commit, though prepareStmt() may have added a table */
+        (void)sqlite3_exec( handle->pDb, "ROLLBACK;", NULL, NULL, NULL );
+        handle->inTxn = false;
+        g_ptr_array_free( rows, TRUE );
+    }
+    return err;
+} /* publishSnapshot */
+
+/* Map the app's snapshot into the handle if there's a sound one to map */
+static LPErr
+mapSnapshot( LPAppHandle_t* handle )
+{
+    LPErr err = LP_ERR_NO_SUCH_KEY;
+    gchar* path = snapshotPath( handle->appId, handle->shared );
+    int fd = open( path, O_RDONLY );
+    g_free( path );
+
+    struct stat st;
+    if ( fd >= 0 && 0 == fstat( fd, &st ) && st.st_size >= sizeof(SnapHeader)
+         && st.st_size <= G_MAXUINT32 ) {
+        gsize size = st.st_size;
+        void* map = mmap( NULL, size, PROT_READ, MAP_SHARED, fd, 0 );
+        if ( MAP_FAILED != map ) {
+            const guint8* base = map;
+            const SnapHeader* header = map;
+            const SnapEntry* entries = (const SnapEntry*)(header + 1);
+            bool sound = !memcmp( header->magic, SNAPSHOT_MAGIC, sizeof(header->magic) )
+                && header->size == size
+                && header->count <= (size - sizeof(SnapHeader)) / sizeof(SnapEntry)
+                && '\0' == base[size-1];
+            guint32 ii;
+            for ( ii = 0; sound && ii < header->count; ++ii ) {
+                sound = entries[ii].key < size
+                    && entries[ii].value < size
+                    && entries[ii].valueLen < size - entries[ii].value;
+            }
+
+            if ( sound ) {
+                handle->snap = base;
+                handle->snapSize = size;
+                err = LP_ERR_NONE;
+            } else {
+                g_warning( "%s: ignoring damaged snapshot for %s", __func__,
+                           handle->appId );
+                (void)munmap( map, size );
+            }
+        }
+    }
+    if ( fd >= 0 ) {
+        (void)close( fd );      /* the mapping outlives it */
+    }
+    return err;
+} /* mapSnapshot */
+
+/* Index of the first entry whose key is >= key */
+static guint32
+snapLowerBound( LPAppHandle_t* handle, const char* key )
+{
+    const SnapHeader* header = (const SnapHeader*)handle->snap;
+    const SnapEntry* entries = (const SnapEntry*)(header + 1);
+    guint32 lo = 0, hi = header->count;
+    while ( lo < hi ) {
+        guint32 mid = lo + (hi - lo) / 2;
+        if ( strcmp( (const char*)handle->snap + entries[mid].key, key ) < 0 ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* copyValueText() for snapshot handles */
+static LPErr
+snapCopyValue( LPAppHandle_t* handle, const char* key, gchar** value,
+               bool* isJson, gint64* version )
+{
+    LPErr err = LP_ERR_NO_SUCH_KEY;
+    const SnapHeader* header = (const SnapHeader*)handle->snap;
+    const SnapEntry* entries = (const SnapEntry*)(header + 1);
+    guint32 ii = snapLowerBound( handle, key );
+    if ( ii < header->count
+         && !strcmp( (const char*)handle->snap + entries[ii].key, key ) ) {
+        *value = g_strndup( (const char*)handle->snap + entries[ii].value,
+                            entries[ii].valueLen );
+        *isJson = !(entries[ii].flags & SNAP_NOT_JSON);
+        *version = entries[ii].version;
+        err = LP_ERR_NONE;
+    }
+    return err;
+}
+
+/* The keys beginning with prefix, for snapshot handles, into a json array */
+static void
+snapCopyKeys( LPAppHandle_t* handle, const char* prefix, struct json_object* jarray )
+{
+    const SnapHeader* header = (const SnapHeader*)handle->snap;
+    const SnapEntry* entries = (const SnapEntry*)(header + 1);
+    if ( NULL == prefix ) {
+        prefix = "";
+    }
+    gsize len = strlen( prefix );
+    guint32 ii;
+    for ( ii = snapLowerBound( handle, prefix ); ii < header->count; ++ii ) {
+        const char* key = (const char*)handle->snap + entries[ii].key;
+        if ( strncmp( key, prefix, len ) ) {
+            break;
+        }
+        json_object_array_add( jarray, json_object_new_string( key ) );
+    }
+}
+
+/* Called on a handle's first write in a transaction */
+static void
+markDirty( LPAppHandle_t* handle )
+{
+    if ( !handle->dirty ) {
+        handle->dirty = true;
+        gchar* path = snapshotPath( handle->appId, handle->shared );
+        handle->republish = 0 == unlink( path );
+        g_free( path );
+    }
+}
+
+/* End the transaction openDB() began, if any. */
+static LPErr
+endTransaction( LPAppHandle_t* handle, bool commit )
+{
+    LPErr lperr = LP_ERR_NONE;
+    if ( handle->pDb && handle->inTxn ) {
+        lperr = runSQL( handle, false, NULL, NULL, "%s;", (commit?"COMMIT":"ROLLBACK") );
+        if ( LP_ERR_NONE == lperr ) {
+            handle->inTxn = false;
+            cacheEndTxn( handle, commit );
+            if ( handle->republish ) {
+                handle->republish = false;
+                (void)publishSnapshot( handle ); /* a reader will, if we can't */
+            }
+        }
+    }
+    return lperr;
+}
+
+/* Whether handles got now should use the shared DB */
+static bool
+useSharedDB( void )
+{
+    G_LOCK( settings );
+    LPStorageMode mode = g_storageMode;
+    G_UNLOCK( settings );
+
+    bool shared = LP_STORAGE_SHARED == mode;
+    if ( LP_STORAGE_AUTO == mode ) {
+        shared = g_file_test( SHARED_DB_PATH, G_FILE_TEST_EXISTS );
+    }
+    return shared;
+}
+
+static LPDurability
+defaultDurability( void )
+{
+    G_LOCK( settings );
+    LPDurability durability = g_defaultDurability;
+    G_UNLOCK( settings );
+    return durability;
+}
+
+LPErr
+LPAppSetStorageMode( LPStorageMode mode )
+{
+    g_return_val_if_fail( mode == LP_STORAGE_AUTO
+                          || mode == LP_STORAGE_PER_APP
+                          || mode == LP_STORAGE_SHARED, -EINVAL );
+    G_LOCK( settings );
+    g_storageMode = mode;
+    G_UNLOCK( settings );
+    return LP_ERR_NONE;
+}
+
+/* Note the last sequence number and the largest version the app's DB at
+ * path gave out, for addTable() to carry on from once it's been deleted and
+ * made afresh. */
+static void
+saveSeqFloor( const char* appId, const char* path )
+{
+    LPAppHandle handle;
+    if ( g_file_test( path, G_FILE_TEST_EXISTS )
+         && LP_ERR_NONE == LPAppGetHandle( appId, &handle ) ) {
+        LPAppHandle_t* hndl = (LPAppHandle_t*)handle;
+        gint64 lastSeq = 0;
+        gint64 lastVersion = 0;
+        sqlite3_stmt* stmt;
+        LPErr err = getStmt( hndl, STMT_LAST_SEQ, &stmt );
+        if ( LP_ERR_NONE == err ) {
+            err = stepStmt( hndl, stmt, getSeq, &lastSeq );
+        }
+        if ( LP_ERR_NONE == err ) {
+            err = getStmt( hndl, STMT_LAST_VERSION, &stmt );
+        }
+        if ( LP_ERR_NONE == err ) {
+            err = stepStmt( hndl, stmt, getSeq, &lastVersion );
+        }
+        if ( LP_ERR_NONE == err && 0 < lastSeq ) {
+            gchar* floorPath = g_strdup_printf( "%s/" SEQ_FLOOR_NAME, hndl->pPath );
+            gchar* text = g_strdup_printf( "%lld %lld", (long long)lastSeq,
+                                           (long long)lastVersion );
+            if ( !g_file_set_contents( floorPath, text, -1, NULL ) ) {
+                g_warning( "%s: can't save %s", __func__, floorPath );
+            }
+            g_free( text );
+            g_free( floorPath );
+        }
+        (void)LPAppFreeHandle( handle, false );
+    }
+}
+
+LPErr
+LPAppClearData( const char* appId )
+{
+    LPErr lperr;
+    (void)clearGenFor( appId, true );
+    gchar* path = g_strdup_printf( APP_PREFS_DIR "/%s/" APP_DB_NAME, appId );
+    if ( !useSharedDB() ) {
+        saveSeqFloor( appId, path );
+    }
+    int err = unlinkDB( path );
+    g_free( path );
+
+    if ( useSharedDB() ) {
+        LPAppHandle handle;
+        lperr = LPAppGetHandle( appId, &handle );
+        if ( LP_ERR_NONE == lperr ) {
+            LPAppHandle_t* hndl = (LPAppHandle_t*)handle;
+            lperr = runSQL( hndl, true, NULL, NULL,
+                            "DELETE FROM appdata WHERE appId = %Q;", appId );
+            if ( LP_ERR_NONE == lperr && 0 == sqlite3_changes( hndl->pDb )
+                 && 0 != err ) {
+                /* nothing here and no DB of its own not yet imported: as
+                   per-app storage says of an app with no data */
+                lperr = LP_ERR_PARAM_ERR;
+            } else if ( LP_ERR_NONE == lperr ) {
+                markDirty( hndl );
+            }
+            LPErr freeErr = LPAppFreeHandle( handle, LP_ERR_NONE == lperr );
+            if ( LP_ERR_NONE == lperr ) {
+                lperr = freeErr;
+            }
+        }
+    } else {
+        lperr = (err == 0)? LP_ERR_NONE : LP_ERR_PARAM_ERR;
+        path = snapshotPath( appId, false );
+        (void)unlink( path );
+        g_free( path );
+    }
+    cacheForgetApp( appId );
+    return lperr;
+}
+
+static LPAppHandle_t*
+newHandle( const char* appId, bool shared, LPDurability durability )
+{
+    LPAppHandle_t* hndl = g_new0( LPAppHandle_t, 1 );
+    hndl->appId = g_strdup( appId );
+    hndl->pPath = g_strdup_printf( APP_PREFS_DIR "/%s", appId );
+    hndl->shared = shared;
+    hndl->pDbPath = hndl->shared ? g_strdup( SHARED_DB_PATH )
+        : g_strdup_printf( "%s/" APP_DB_NAME, hndl->pPath );
+    hndl->durability = durability;
+    return hndl;
+}
+
+LPErr
+LPAppGetHandle( const char* appId, LPAppHandle* handle )
+{
+    g_return_val_if_fail( handle != NULL, -EINVAL );
+    *handle = NULL;
+
+    g_return_val_if_fail( appId != NULL, -EINVAL );
+
+    *handle = (LPAppHandle)newHandle( appId, useSharedDB(), defaultDurability() );
+
+    return 0;
+} /* LPAppGetHandle */
+
+LPErr
+LPAppGetSnapshotHandle( const char* appId, LPAppHandle* handle )
+{
+    LPErr err = LPAppGetHandle( appId, handle );
+    if ( LP_ERR_NONE == err ) {
+        LPAppHandle_t* hndl = (LPAppHandle_t*)*handle;
+        hndl->readOnly = true;
+        if ( LP_ERR_NONE != mapSnapshot( hndl )
+             && LP_ERR_NONE == publishSnapshot( hndl ) ) {
+            (void)mapSnapshot( hndl );
+        }
+        /* Without one (a writer holds the lock, say) we read the DB */
+    }
+    return err;
+} /* LPAppGetSnapshotHandle */
+
+LPErr
+LPAppFreeHandle( LPAppHandle handle, bool commit )
+{
+    LPErr lperr = LP_ERR_NONE;
+    g_return_val_if_fail( handle != NULL, -EINVAL );
+    LPAppHandle_t* hndl = (LPAppHandle_t*)handle;
+
+    if ( hndl->pDb ) {
+        finalizeStmts( hndl );  /* sqlite3_close() fails while any are live */
+        lperr = endTransaction( hndl, commit );
+        if ( LP_ERR_NONE == lperr ) {
+            lperr = sqlerr_to_lperr(sqlite3_close( hndl->pDb ) );
+            hndl->pDb = NULL;
+        }
+    }
+
+    if ( NULL != hndl->snap ) {
+        (void)munmap( (void*)hndl->snap, hndl->snapSize );
+    }
+    g_free( hndl->appId );
+    g_free( hndl->pPath );
+    g_free( hndl->pDbPath );
+    g_free( hndl );
+    return lperr;
+}
+
+LPErr
+LPAppFlushHandle( LPAppHandle handle, bool commit )
+{
+    g_return_val_if_fail( handle != NULL, -EINVAL );
+    return endTransaction( (LPAppHandle_t*)handle, commit );
+}
+
+LPErr
+LPAppHandleIsStale( LPAppHandle handle, bool* stale )
+{
+    g_return_val_if_fail( handle != NULL, -EINVAL );
+    g_return_val_if_fail( stale != NULL, -EINVAL );
+    LPAppHandle_t* hndl = (LPAppHandle_t*)handle;
+
+    *stale = false;
+    if ( NULL != hndl->pDb ) {
+        struct stat st;
+        *stale = hndl->clearGen != clearGenFor( hndl->appId, false )
+            || 0 != stat( hndl->pDbPath, &st )
+            || st.st_dev != hndl->dbDev || st.st_ino != hndl->dbIno;
+    }
+    return LP_ERR_NONE;
+}
+
+LPErr
+LPAppSetDefaultDurability( LPDurability durability )
+{
+    g_return_val_if_fail( durability == LP_DURABILITY_STRICT
+                          || durability == LP_DURABILITY_WAL, -EINVAL );
+    G_LOCK( settings );
+    g_defaultDurability = durability;
+    G_UNLOCK( settings );
+    return LP_ERR_NONE;
+}
+
+LPErr
+LPAppSetDurability( LPAppHandle handle, LPDurability durability )
+{
+    g_return_val_if_fail( handle != NULL, -EINVAL );
+    g_return_val_if_fail( durability == LP_DURABILITY_STRICT
+                          || durability == LP_DURABILITY_WAL, -EINVAL );
+    LPAppHandle_t* hndl = (LPAppHandle_t*)handle;
+
+    LPErr err = LP_ERR_NONE;
+    if ( hndl->inTxn ) {
+        err = LP_ERR_BUSY;
+    } else {
+        hndl->durability = durability;
+        if ( NULL != hndl->pDb ) {
+            err = applyDurability( hndl );
+        }
+    }
+    return err;
+}
+
+LPErr
+LPAppSetCacheBudget( size_t bytes )
+{
+    G_LOCK( cache );
+    g_cache.budget = bytes;
+    cacheTrim( bytes );
+    G_UNLOCK( cache );
+    return LP_ERR_NONE;
+}
+
+LPErr
+LPAppGetCacheStats( LPAppCacheStats* stats )
+{
+    g_return_val_if_fail( stats != NULL, -EINVAL );
+    G_LOCK( cache );
+    *stats = g_cache.stats;
+    G_UNLOCK( cache );
+    return LP_ERR_NONE;
+}
+
+LPErr
+LPAppCheckpoint( LPAppHandle handle )
+{
+    g_return_val_if_fail( handle != NULL, -EINVAL );
+    LPAppHandle_t* hndl = (LPAppHandle_t*)handle;
+
+    LPErr err = LP_ERR_NONE;
+    if ( hndl->inTxn ) {
+        err = LP_ERR_BUSY;
+    } else if ( NULL != hndl->pDb ) {
+        /* a no-op returning SQLITE_OK if the DB isn't in WAL mode */
+        err = sqlerr_to_lperr( sqlite3_wal_checkpoint( hndl->pDb, NULL ) );
+    }
+    return err;
+}
+
+/* The DB LPAppMaintain() last went over, and how its files were after.  In
+ * the shared DB every app's pass would be over the same file, so only the
+ * first after a change does anything. */
+static struct {
+    gchar*    path;
+    FileStamp db;
+    FileStamp wal;
+} g_maintained = { NULL, };
+G_LOCK_DEFINE_STATIC( maintained );
+
+LPErr
+LPAppMaintain( LPAppHandle handle, int pages )
+{
+    g_return_val_if_fail( handle != NULL, -EINVAL );
+    g_return_val_if_fail( pages >= 0, -EINVAL );
+    LPAppHandle_t* hndl = (LPAppHandle_t*)handle;
+
+    FileStamp db, wal;
+    stampDB( hndl->pDbPath, &db, &wal );
+    G_LOCK( maintained );
+    bool done = NULL != g_maintained.path
+        && !strcmp( g_maintained.path, hndl->pDbPath )
+        && !memcmp( &db, &g_maintained.db, sizeof(db) )
+        && !memcmp( &wal, &g_maintained.wal, sizeof(wal) );
+    G_UNLOCK( maintained );
+
+    LPErr err = LP_ERR_NONE;
+    int analyzed = 0;
+    if ( hndl->inTxn ) {
+        err = LP_ERR_BUSY;
+    } else if ( !done ) {
+        err = openConnection( hndl );
+    }
+    if ( LP_ERR_NONE == err && !done ) {
+        /* Statistics are gathered in full once; after that PRAGMA optimize
+           redoes them only for tables that look to need it. */
+        err = sqlerr_to_lperr( hasTable( hndl->pDb, "sqlite_stat1", &analyzed ) );
+    }
+    if ( LP_ERR_NONE == err && !done ) {
+        /* A no-op if the DB predates auto_vacuum.  Each runs as a
+           transaction of its own. */
+        char* sql = sqlite3_mprintf( "PRAGMA incremental_vacuum(%d); %s",
+                                     pages, analyzed ? "PRAGMA optimize;"
+                                     : "ANALYZE;" );
+        char* errmsg = NULL;
+        int result = sqlite3_exec( hndl->pDb, sql, NULL, NULL, &errmsg );
+        if ( SQLITE_OK != result ) {
+            fprintf( stderr, "sqlite3_exec(\"%s\")=>%d/\"%s\"\n", sql, result,
+                     NULL != errmsg ? errmsg : "" );
+            sqlite3_free( errmsg );
+        }
+        sqlite3_free( sql );
+        err = sqlerr_to_lperr( result );
+    }
+    if ( LP_ERR_NONE == err && !done ) {
+        /* in WAL mode, that's what actually shrinks the file */
+        err = LPAppCheckpoint( handle );
+    }
+    if ( LP_ERR_NONE == err && !done ) {
+        stampDB( hndl->pDbPath, &db, &wal );
+        G_LOCK( maintained );
+        g_free( g_maintained.path );
+        g_maintained.path = g_strdup( hndl->pDbPath );
+        g_maintained.db = db;
+        g_maintained.wal = wal;
+        G_UNLOCK( maintained );
+    }
+    return err;
+} /* LPAppMaintain */
+
+/* A value as stored, whether it was checked on the way in, and its version */
+typedef struct StoredValue {
+    gchar* text;
+    bool   isJson;
+    gint64 version;
+} StoredValue;
+
+static int
+getValue( sqlite3_stmt* stmt, void* context )
+{
+    g_assert( sqlite3_column_count( stmt ) == 3 ); /* I asked for three columns, not '*' */
+    StoredValue* result = (StoredValue*)context;
+    result->text = g_strdup( (const gchar*)sqlite3_column_text( stmt, 0 ) );
+    result->isJson = VALUE_JSON == sqlite3_column_int( stmt, 1 );
+    result->version = sqlite3_column_int64( stmt, 2 );
+    return 0;      /* non-0 return aborts, and causes stepStmt to return
+                      SQLITE_ABORT  */
+}
+
+#ifdef USE_MJSON
+static void
+cjson_to_mjson_put( json_t** jsont, struct json_object* json )
+{
+    const char* asStr = json_object_get_string( json );
+    *jsont = json_parse_document( asStr );
+    json_object_put( json );
+}
+#endif
+
+#ifdef USE_MJSON
+static void
+mjson_to_cjson( struct json_object** json, const json_t* jsont )
+{
+    char *text = NULL;
+    enum json_error err = json_tree_to_string( (json_t*)jsont, &text );
+    if ( JSON_OK == err )
+    {
+        *json = json_tokener_parse( text );
+        g_free( text );
+    } else {
+        g_assert(0);            /* what to do? */
+    }
+}
+#endif
+
+/*
+ * Fetch the stored text for key, as is.  Callers decide how to check that
+ * it's json: parsing it is the expensive part of a read, so it should happen
+ * once at most, and not at all if value->isJson.
+ */
+static LPErr
+copyValueText( LPAppHandle handle, const char* key, StoredValue* value )
+{
+    LPAppHandle_t* hndl = (LPAppHandle_t*)handle;
+    sqlite3_stmt* stmt;
+    LPErr err;
+
+    value->text = NULL;
+    value->isJson = false;
+    value->version = 0;
+    if ( NULL != hndl->snap ) {
+        err = snapCopyValue( hndl, key, &value->text, &value->isJson,
+                             &value->version );
+    } else {
+        err = openDB( hndl ); /* the cache needs to know the transaction */
+        if ( LP_ERR_NONE == err ) {
+            value->text = cacheLookup( hndl, key, &value->version );
+        }
+
+        if ( NULL != value->text ) {
+            value->isJson = true;   /* nothing else gets cached */
+        } else {
+            if ( LP_ERR_NONE == err ) {
+                err = getStmt( hndl, STMT_GET_VALUE, &stmt );
+            }
+            if ( LP_ERR_NONE == err ) {
+                bindText( stmt, ":key", key );
+                err = stepStmt( hndl, stmt, getValue, value );
+            }
+
+            if ( err == 0 && !value->text ) { /* will be null if getValue() never fired */
+                err = LP_ERR_NO_SUCH_KEY;
+            } else if ( err == 0 && value->isJson ) {
+                cacheStore( hndl, key, value->text, value->version );
+            }
+        }
+    }
+    return err;
+}
+
+LPErr
+LPAppCopyValueVersioned( LPAppHandle handle, const char* key, char** jstr,
+                         long long* version )
+{
+    g_return_val_if_fail( version != NULL, -EINVAL );
+    g_return_val_if_fail( handle != NULL, -EINVAL );
+    g_return_val_if_fail( key != NULL, -EINVAL );
+    g_return_val_if_fail( jstr != NULL, -EINVAL );
+
+    StoredValue value;
+    LPErr err = copyValueText( handle, key, &value );
+
+    if ( err == 0 ) {
+        if ( !value.isJson && !check_is_json(value.text) ) {
+            g_critical( "non-json value stored: %s", value.text );
+            err = LP_ERR_VALUENOTJSON;
+        } else {
+            *jstr = value.text;
+            *version = value.version;
+            value.text = NULL;
+        }
+    }
+
+    g_free( value.text );
+    return err;
+}
+
+LPErr
+LPAppCopyValue( LPAppHandle handle, const char* key, char** jstr )
+{
+    long long version;
+    return LPAppCopyValueVersioned( handle, key, jstr, &version );
+}
+
+LPErr
+LPAppCopyValues( LPAppHandle handle, const char* const keys[],
+                 char* jstrs[], LPErr errs[], int n )
+{
+    g_return_val_if_fail( handle != NULL, -EINVAL );
+    g_return_val_if_fail( n >= 0, -EINVAL );
+    g_return_val_if_fail( n == 0 || (keys != NULL && jstrs != NULL), -EINVAL );
+
+    LPErr err = LP_ERR_NONE;
+    int ii;
+
+    for ( ii = 0; ii < n; ++ii ) {
+        jstrs[ii] = NULL;
+        if ( NULL != errs ) {
+            errs[ii] = LP_ERR_PARAM_ERR;
+        }
+    }
+
+    /* Every lookup reuses the handle's one compiled SELECT */
+    for ( ii = 0; LP_ERR_NONE == err && ii < n; ++ii ) {
+        LPErr keyErr = LP_ERR_PARAM_ERR;
+        if ( NULL != keys[ii] ) {
+            keyErr = LPAppCopyValue( handle, keys[ii], &jstrs[ii] );
+        }
+        if ( NULL != errs ) {
+            errs[ii] = keyErr;
+        }
+        if ( LP_ERR_BUSY == keyErr || LP_ERR_DBERROR == keyErr
+             || LP_ERR_INVALID_HANDLE == keyErr ) {
+            err = keyErr;       /* no point going on */
+        }
+    }
+    return err;
+} /* LPAppCopyValues */
+
+LPErr
+LPAppCopyValueString( LPAppHandle handle, const char* key, char** str )
+{
+    struct json_object* json;
+    LPErr err = LPAppCopyValueCJ( handle, key, &json );
+    if ( LP_ERR_NONE == err && json_object_is_type( json, json_type_array ) )
+    {
+        /* assume it's an array of length one.  Return the string at elem 0. */
+        struct json_object* child = json_object_array_get_idx( json, 0 );
+
+        if ( (NULL != child) && ( json_object_is_type( child, json_type_string)) )
+        {
+            *str = g_strdup( json_object_get_string( child ) );
+        }
+        else
+        {
+            err = LP_ERR_VALUENOTJSON;
+        }
+        json_object_put( json );
+    }
+    return err;
+}
+
+LPErr
+LPAppCopyValueInt( LPAppHandle handle, const char* key, int* intValue )
+{
+    struct json_object* json;
+    LPErr err = LPAppCopyValueCJ( handle, key, &json );
+    if ( LP_ERR_NONE == err )
+    {
+        /* assume it's an array of length one.  Return the string at elem 0. */
+        struct json_object* child = json_object_array_get_idx( json, 0 );
+        if ( (NULL != child) && json_object_is_type( child, json_type_string) )
+        {
+            *intValue = atoi( json_object_get_string( child ) );
+        }
+        else
+        {
+            err = LP_ERR_VALUENOTJSON;
+        }
+        json_object_put( json );
+    }
+
+    return err;
+}
+
+#ifdef USE_MJSON
+LPErr
+LPAppCopyValueJ( LPAppHandle handle, const char* key, json_t** jsont )
+{
+    LPErr err;
+    struct json_object* json;
+    err = LPAppCopyValueCJ( handle, key, &json );
+    if ( LP_ERR_NONE == err ) {
+        cjson_to_mjson_put( jsont, json );
+    }
+    return err;
+}
+#endif
+
+LPErr
+LPAppCopyValueCJ( LPAppHandle handle, const char* key, struct json_object** json )
+{
+    g_return_val_if_fail( handle != NULL, -EINVAL );
+    g_return_val_if_fail( key != NULL, -EINVAL );
+    g_return_val_if_fail( json != NULL, -EINVAL );
+
+    /* Not LPAppCopyValue(): it would parse the value only to throw the
+       result away, and we'd parse it again. */
+    StoredValue value;
+    LPErr err = copyValueText( handle, key, &value );
+
+    if ( LP_ERR_NONE == err )
+    {
+        err = strToJsonWithCheck( value.text, json );
+    }
+
+    g_free( value.text );
+    return err;
+}
+
+static LPErr
+copy_as_string( struct json_object* json, char** out )
+{
+    LPErr err = LP_ERR_NONE;
     const char* txt = json_object_get_string( json );
     g_assert( !!txt );
     *out = g_strdup( txt );
@@ -497,11 +2330,12 @@ copy_as_string( struct json_object* json, char** out )
 }
 
 static int
-addValueToArray( void* context, int nColumns, char** colValues, char** colNames )
+addValueToArray( sqlite3_stmt* stmt, void* context )
 {
-    g_assert( nColumns == 1 );
+    g_assert( sqlite3_column_count( stmt ) == 1 );
     struct json_object* jarray = (struct json_object*)context;
-	struct json_object* jstr = json_object_new_string( colValues[0] );
+	struct json_object* jstr =
+        json_object_new_string( (const char*)sqlite3_column_text( stmt, 0 ) );
 
 	json_object_array_add( jarray, jstr );
 
@@ -510,6 +2344,12 @@ addValueToArray( void* context, int nColumns, char** colValues, char** colNames
 
 LPErr
 LPAppCopyKeys( LPAppHandle handle, char** jstr )
+{
+    return LPAppCopyKeysWithPrefix( handle, NULL, jstr );
+} /* LPAppCopyKeys */
+
+LPErr
+LPAppCopyKeysWithPrefix( LPAppHandle handle, const char* prefix, char** jstr )
 {
     LPErr err = -EINVAL;
     g_return_val_if_fail( handle != NULL, -EINVAL );
@@ -517,7 +2357,13 @@ LPAppCopyKeys( LPAppHandle handle, char** jstr )
 
 	struct json_object* jarray = json_object_new_array();
 
-    err = runSQL( handle, true, addValueToArray, jarray, "SELECT key FROM data;" );
+    if ( NULL != ((LPAppHandle_t*)handle)->snap ) {
+        snapCopyKeys( handle, prefix, jarray );
+        err = LP_ERR_NONE;
+    } else {
+        err = runPrefixScan( handle, prefix, STMT_COPY_KEYS, STMT_COPY_KEYS_RANGE,
+                             STMT_COPY_KEYS_FROM, addValueToArray, jarray );
+    }
 
     if ( 0 == err ) {
         err = copy_as_string( jarray, jstr );
@@ -525,7 +2371,7 @@ LPAppCopyKeys( LPAppHandle handle, char** jstr )
 
     json_object_put( jarray );
     return err;
-} /* LPAppCopyKeys */
+} /* LPAppCopyKeysWithPrefix */
 
 #ifdef USE_MJSON
 LPErr
@@ -543,6 +2389,13 @@ LPAppCopyKeysJ( LPAppHandle handle, json_t** jsont )
 
 LPErr
 LPAppCopyKeysCJ( LPAppHandle handle, struct json_object** json )
+{
+    return LPAppCopyKeysWithPrefixCJ( handle, NULL, json );
+}
+
+LPErr
+LPAppCopyKeysWithPrefixCJ( LPAppHandle handle, const char* prefix,
+                           struct json_object** json )
 {
     LPErr err = -EINVAL;
     g_return_val_if_fail( handle != NULL, -EINVAL );
@@ -550,7 +2403,13 @@ LPAppCopyKeysCJ( LPAppHandle handle, struct json_object** json )
 
 	struct json_object* jarray = json_object_new_array();
 
-    err = runSQL( handle, true, addValueToArray, jarray, "SELECT key FROM data;" );
+    if ( NULL != ((LPAppHandle_t*)handle)->snap ) {
+        snapCopyKeys( handle, prefix, jarray );
+        err = LP_ERR_NONE;
+    } else {
+        err = runPrefixScan( handle, prefix, STMT_COPY_KEYS, STMT_COPY_KEYS_RANGE,
+                             STMT_COPY_KEYS_FROM, addValueToArray, jarray );
+    }
 
     if ( LP_ERR_NONE == err )
     {
@@ -564,18 +2423,25 @@ LPAppCopyKeysCJ( LPAppHandle handle, struct json_object** json )
 }
 
 static int
-addKeyValueToArray( void* context, int nColumns, char** colValues, char** colNames )
+addKeyValueToArray( sqlite3_stmt* stmt, void* context )
 {
     int err = -1;
-    g_assert( nColumns == 2 );
+    g_assert( sqlite3_column_count( stmt ) == 3 );
     struct json_object* jarray = (struct json_object*)context;
     struct json_object* obj = json_object_new_object();
     if ( NULL != obj ) {
-        struct json_object* value = json_tokener_parse( colValues[1] );
+        struct json_object* value =
+            json_tokener_parse( (const char*)sqlite3_column_text( stmt, 1 ) );
         if ( !is_error(value) && is_toplevel_json(value) ) {
-            json_object_object_add( obj, colValues[0], value );
+            json_object_object_add( obj, (const char*)sqlite3_column_text( stmt, 0 ),
+                                    value );
             json_object_array_add( jarray, obj );
             err = 0;
+        } else {
+            if ( !is_error(value) ) {
+                json_object_put( value );
+            }
+            json_object_put( obj );
         }
     }
 
@@ -585,76 +2451,525 @@ addKeyValueToArray( void* context, int nColumns, char** colValues, char** colNam
 LPErr
 LPAppCopyAll( LPAppHandle handle, char** jstr )
 {
-    LPErr err;
+    return LPAppCopyAllWithPrefix( handle, NULL, jstr );
+}
+
+/*
+ * addKeyValueToArray() for callers who want text: splice the stored value
+ * into the output as is rather than parse it only to print it again; it was
+ * printed by json-c on the way in.  Only the key goes through cjson, to get
+ * it quoted and escaped, and an unchecked value, to get it printed the same.
+ */
+static int
+appendKeyValueText( sqlite3_stmt* stmt, void* context )
+{
+    g_assert( sqlite3_column_count( stmt ) == 3 );
+    GString* out = (GString*)context;
+    const char* value = (const char*)sqlite3_column_text( stmt, 1 );
+    gchar* normal = NULL;
+
+    if ( VALUE_JSON != sqlite3_column_int( stmt, 2 ) ) {
+        normal = NULL == value ? NULL : normalize_json( value );
+        if ( NULL == normal ) {
+            return -1;
+        }
+        value = normal;
+    }
+
+    struct json_object* jkey =
+        json_object_new_string( (const char*)sqlite3_column_text( stmt, 0 ) );
+    g_string_append( out, out->len > 1 ? ", { " : " { " );
+    g_string_append( out, json_object_to_json_string( jkey ) );
+    g_string_append( out, ": " );
+    g_string_append( out, value );
+    g_string_append( out, " }" );
+    json_object_put( jkey );
+    g_free( normal );
+
+    return 0;
+} /* appendKeyValueText */
+
+LPErr
+LPAppCopyAllWithPrefix( LPAppHandle handle, const char* prefix, char** jstr )
+{
+    g_return_val_if_fail( handle != NULL, -EINVAL );
+    g_return_val_if_fail( jstr != NULL, -EINVAL );
+
+    GString* out = g_string_new( "[" );
+    LPErr err = runPrefixScan( handle, prefix, STMT_COPY_ALL, STMT_COPY_ALL_RANGE,
+                               STMT_COPY_ALL_FROM, appendKeyValueText, out );
+
+    if ( 0 == err ) {
+        g_string_append( out, " ]" );
+        *jstr = g_string_free( out, FALSE );
+    } else {
+        g_string_free( out, TRUE );
+    }
+    return err;
+}
+
+#ifdef USE_MJSON
+LPErr
+LPAppCopyAllJ( LPAppHandle handle, json_t** jsont )
+{
+    LPErr err;
+    struct json_object* json;
+    err = LPAppCopyAllCJ( handle, &json );
+    if ( LP_ERR_NONE == err ) {
+        cjson_to_mjson_put( jsont, json );
+    }
+    return err;
+}
+#endif
+
+LPErr
+LPAppCopyAllCJ( LPAppHandle handle, struct json_object** json )
+{
+    return LPAppCopyAllWithPrefixCJ( handle, NULL, json );
+}
+
+LPErr
+LPAppCopyAllWithPrefixCJ( LPAppHandle handle, const char* prefix,
+                          struct json_object** json )
+{
+    LPErr err;
+    g_return_val_if_fail( handle != NULL, -EINVAL );
+    g_return_val_if_fail( json != NULL, -EINVAL );
+
+    /* addKeyValueToArray() parses each value once, and checks it while it's
+       at it; what it builds is what we return. */
+	struct json_object* jarray = json_object_new_array();
+
+    err = runPrefixScan( handle, prefix, STMT_COPY_ALL, STMT_COPY_ALL_RANGE,
+                         STMT_COPY_ALL_FROM, addKeyValueToArray, jarray );
+
+    if ( LP_ERR_NONE == err ) {
+        *json = jarray;
+    } else {
+        json_object_put( jarray );
+    }
+    return err;
+}
+
+/* {"key": key, "value": value, "seq": seq}, for LPAppCopyChangesSince().
+ * A value that isn't json -- not yet checked, and failing -- goes as a
+ * string rather than failing the whole read. */
+static int
+addChangeToArray( sqlite3_stmt* stmt, void* context )
+{
+    g_assert( sqlite3_column_count( stmt ) == 3 );
+    struct json_object* obj = json_object_new_object();
+    const char* text = (const char*)sqlite3_column_text( stmt, 1 );
+    struct json_object* value = json_tokener_parse( text );
+    if ( is_error(value) ) {
+        value = json_object_new_string( text );
+    } else if ( !is_toplevel_json(value) ) {
+        json_object_put( value );
+        value = json_object_new_string( text );
+    }
+    json_object_object_add( obj, "key",
+        json_object_new_string( (const char*)sqlite3_column_text( stmt, 0 ) ) );
+    json_object_object_add( obj, "value", value );
+    json_object_object_add( obj, "seq",
+                            json_object_new_int64( sqlite3_column_int64( stmt, 2 ) ) );
+    json_object_array_add( (struct json_object*)context, obj );
+    return 0;
+}
+
+/* {"key": key, "seq": seq}, for LPAppCopyChangesSince() */
+static int
+addRemovalToArray( sqlite3_stmt* stmt, void* context )
+{
+    g_assert( sqlite3_column_count( stmt ) == 2 );
+    struct json_object* obj = json_object_new_object();
+    json_object_object_add( obj, "key",
+        json_object_new_string( (const char*)sqlite3_column_text( stmt, 0 ) ) );
+    json_object_object_add( obj, "seq",
+                            json_object_new_int64( sqlite3_column_int64( stmt, 1 ) ) );
+    json_object_array_add( (struct json_object*)context, obj );
+    return 0;
+}
+
+LPErr
+LPAppCopyChangesSinceCJ( LPAppHandle handle, long long seq, struct json_object** json )
+{
+    g_return_val_if_fail( handle != NULL, -EINVAL );
+    g_return_val_if_fail( json != NULL, -EINVAL );
+
+    LPAppHandle_t* hndl = (LPAppHandle_t*)handle;
+    struct json_object* changed = json_object_new_array();
+    struct json_object* removed = json_object_new_array();
+    gint64 lastSeq = 0;
+    gint64 seqFloor = 0;
+    bool reset = false;
+    sqlite3_stmt* stmt;
+
+    /* All four in the handle's one transaction, so they agree */
+    LPErr err = getStmt( hndl, STMT_LAST_SEQ, &stmt );
+    if ( LP_ERR_NONE == err ) {
+        err = stepStmt( hndl, stmt, getSeq, &lastSeq );
+    }
+    if ( LP_ERR_NONE == err ) {
+        err = getStmt( hndl, STMT_SEQ_FLOOR, &stmt );
+    }
+    if ( LP_ERR_NONE == err ) {
+        err = stepStmt( hndl, stmt, getSeq, &seqFloor );
+    }
+    if ( LP_ERR_NONE == err
+         && ( seq > lastSeq || ( 0 < seq && seq <= seqFloor ) ) ) {
+        /* a number we never gave out, or one from before LPAppClearData():
+           either way the DB it came from, and what it held, is gone */
+        reset = true;
+        seq = 0;
+    }
+    if ( LP_ERR_NONE == err ) {
+        err = getStmt( hndl, STMT_CHANGED_SINCE, &stmt );
+    }
+    if ( LP_ERR_NONE == err ) {
+        bindInt64( stmt, ":seq", seq );
+        err = stepStmt( hndl, stmt, addChangeToArray, changed );
+    }
+    if ( LP_ERR_NONE == err ) {
+        err = getStmt( hndl, STMT_REMOVED_SINCE, &stmt );
+    }
+    if ( LP_ERR_NONE == err ) {
+        bindInt64( stmt, ":seq", seq );
+        err = stepStmt( hndl, stmt, addRemovalToArray, removed );
+    }
+
+    if ( LP_ERR_NONE == err ) {
+        *json = json_object_new_object();
+        json_object_object_add( *json, "seq", json_object_new_int64( lastSeq ) );
+        if ( reset ) {
+            json_object_object_add( *json, "reset", json_object_new_boolean( true ) );
+        }
+        json_object_object_add( *json, "changed", changed );
+        json_object_object_add( *json, "removed", removed );
+    } else {
+        json_object_put( changed );
+        json_object_put( removed );
+    }
+    return err;
+} /* LPAppCopyChangesSinceCJ */
+
+LPErr
+LPAppCopyChangesSince( LPAppHandle handle, long long seq, char** jstr )
+{
+    g_return_val_if_fail( jstr != NULL, -EINVAL );
+
+    struct json_object* json;
+    LPErr err = LPAppCopyChangesSinceCJ( handle, seq, &json );
+    if ( LP_ERR_NONE == err ) {
+        *jstr = g_strdup( json_object_to_json_string( json ) );
+        json_object_put( json );
+    }
+    return err;
+}
+
+LPErr
+LPAppIterBegin( LPAppHandle handle, const char* prefix, LPAppIterator* iter )
+{
+    g_return_val_if_fail( handle != NULL, -EINVAL );
+    g_return_val_if_fail( iter != NULL, -EINVAL );
+    *iter = NULL;
+
+    LPAppIterator_t* it = g_new0( LPAppIterator_t, 1 );
+    it->handle = (LPAppHandle_t*)handle;
+
+    int which = ITER_SQL_FULL;
+    if ( NULL != prefix && '\0' != *prefix ) {
+        it->lo = g_strdup( prefix );
+        it->hi = prefixUpperBound( prefix );
+        which = NULL != it->hi ? ITER_SQL_RANGE : ITER_SQL_FROM;
+    }
+
+    const char* sql = it->handle->shared ? g_shared_iter_sql[which]
+                                         : g_iter_sql[which];
+    LPErr err = prepareStmt( it->handle, sql, &it->stmt );
+    if ( LP_ERR_NONE == err ) {
+        bindText( it->stmt, ":app", it->handle->appId );
+        bindText( it->stmt, ":lo", it->lo );
+        bindText( it->stmt, ":hi", it->hi );
+        *iter = (LPAppIterator)it;
+    } else {
+        (void)LPAppIterEnd( (LPAppIterator)it );
+    }
+    return err;
+} /* LPAppIterBegin */
+
+LPErr
+LPAppIterNext( LPAppIterator iter, const char** key, const char** jstr )
+{
+    g_return_val_if_fail( iter != NULL, -EINVAL );
+    g_return_val_if_fail( key != NULL, -EINVAL );
+    g_return_val_if_fail( jstr != NULL, -EINVAL );
+    LPAppIterator_t* it = (LPAppIterator_t*)iter;
+
+    LPErr err;
+    /* stepping a finished statement again would start the walk over */
+    int result = it->done ? SQLITE_DONE : sqlite3_step( it->stmt );
+    if ( SQLITE_ROW == result ) {
+        *key = (const char*)sqlite3_column_text( it->stmt, 0 );
+        *jstr = (const char*)sqlite3_column_text( it->stmt, 1 );
+        if ( NULL == *jstr ) {
+            g_critical( "null value stored for %s", *key );
+            err = LP_ERR_VALUENOTJSON;
+        } else if ( VALUE_JSON == sqlite3_column_int( it->stmt, 2 )
+                    || check_is_json( *jstr ) ) {
+            err = LP_ERR_NONE;
+        } else {
+            g_critical( "non-json value stored: %s", *jstr );
+            err = LP_ERR_VALUENOTJSON;
+        }
+    } else if ( SQLITE_DONE == result ) {
+        it->done = true;
+        err = LP_ERR_NO_SUCH_KEY;
+    } else {
+        it->done = true;
+        err = sqlerr_to_lperr( result );
+    }
+    return err;
+} /* LPAppIterNext */
+
+LPErr
+LPAppIterEnd( LPAppIterator iter )
+{
+    g_return_val_if_fail( iter != NULL, -EINVAL );
+    LPAppIterator_t* it = (LPAppIterator_t*)iter;
+
+    (void)sqlite3_finalize( it->stmt ); /* a no-op if NULL */
+    g_free( it->lo );
+    g_free( it->hi );
+    g_free( it );
+    return LP_ERR_NONE;
+}
+
+static LPErr
+setValueString( LPAppHandle handle, const char* key, const char* jstr )
+{
+    sqlite3_stmt* stmt;
+    LPErr err = LP_ERR_READONLY;
+    if ( !((LPAppHandle_t*)handle)->readOnly ) {
+        err = getStmt( handle, STMT_SET_VALUE, &stmt );
+    }
+    if ( LP_ERR_NONE == err ) {
+        bindText( stmt, ":key", key );
+        bindText( stmt, ":value", jstr );
+        err = stepStmt( handle, stmt, NULL, NULL );
+    }
+    if ( LP_ERR_NONE == err && 0 < sqlite3_changes( ((LPAppHandle_t*)handle)->pDb ) ) {
+        markDirty( handle );
+    }
+    return err;
+}
+
+LPErr
+LPAppSetValue( LPAppHandle handle, const char* key, const char* const jstr )
+{
     g_return_val_if_fail( handle != NULL, -EINVAL );
+    g_return_val_if_fail( key != NULL, -EINVAL );
     g_return_val_if_fail( jstr != NULL, -EINVAL );
 
-	struct json_object* jarray = json_object_new_array();
-
-    err = runSQL( handle, true, addKeyValueToArray, jarray, "SELECT key,value FROM data;" );
-
-    if ( 0 == err ) {
-        err = copy_as_string( jarray, jstr );
+    LPErr err;
+    gchar* normal = NULL;
+    if ( *key == '\0' ) {       /* empty string? */
+        err = LP_ERR_ILLEGALKEY;
+    } else if ( NULL == (normal = normalize_json( jstr )) ) {
+        err = LP_ERR_VALUENOTJSON;
+    } else {
+        /* Use REPLACE, not INSERT, to avoid duplicates.  */
+        err = setValueString( handle, key, normal );
     }
-
-    json_object_put( jarray );
+    g_free( normal );
     return err;
-}
+} /* LPAppSetValue */
 
-#ifdef USE_MJSON
 LPErr
-LPAppCopyAllJ( LPAppHandle handle, json_t** jsont )
+LPAppCompareAndSetValue( LPAppHandle handle, const char* key,
+                         long long expectedVersion, const char* const jstr,
+                         long long* newVersion )
 {
+    g_return_val_if_fail( handle != NULL, -EINVAL );
+    g_return_val_if_fail( key != NULL, -EINVAL );
+    g_return_val_if_fail( jstr != NULL, -EINVAL );
+    g_return_val_if_fail( expectedVersion >= 0, -EINVAL );
+
+    LPAppHandle_t* hndl = (LPAppHandle_t*)handle;
+    sqlite3_stmt* stmt;
+    gchar* normal = NULL;
     LPErr err;
-    struct json_object* json;
-    err = LPAppCopyAllCJ( handle, &json );
+    if ( *key == '\0' ) {
+        err = LP_ERR_ILLEGALKEY;
+    } else if ( NULL == (normal = normalize_json( jstr )) ) {
+        err = LP_ERR_VALUENOTJSON;
+    } else if ( hndl->readOnly ) {
+        err = LP_ERR_READONLY;
+    } else {
+        /* The test and the write are one statement, so no other connection
+           can get in between them. */
+        err = getStmt( hndl, 0 == expectedVersion ? STMT_CAS_INSERT
+                       : STMT_CAS_UPDATE, &stmt );
+    }
     if ( LP_ERR_NONE == err ) {
-        cjson_to_mjson_put( jsont, json );
+        bindText( stmt, ":key", key );
+        bindText( stmt, ":value", normal );
+        bindInt64( stmt, ":version", expectedVersion );
+        err = stepStmt( hndl, stmt, NULL, NULL );
+    }
+    if ( LP_ERR_NONE == err ) {
+        if ( 0 == sqlite3_changes( hndl->pDb ) ) {
+            err = LP_ERR_VERSION_MISMATCH;
+        } else {
+            markDirty( hndl );
+        }
+    }
+    if ( LP_ERR_NONE == err && NULL != newVersion ) {
+        if ( 0 != expectedVersion ) {
+            *newVersion = expectedVersion + 1;
+        } else {
+            /* a key removed before carries on from its old version */
+            StoredValue value = { NULL, false, 0 };
+            err = getStmt( hndl, STMT_GET_VALUE, &stmt );
+            if ( LP_ERR_NONE == err ) {
+                bindText( stmt, ":key", key );
+                err = stepStmt( hndl, stmt, getValue, &value );
+            }
+            *newVersion = value.version;
+            g_free( value.text );
+        }
     }
+    g_free( normal );
     return err;
-}
-#endif
+} /* LPAppCompareAndSetValue */
 
-LPErr
-LPAppCopyAllCJ( LPAppHandle handle, struct json_object** json )
+/*
+ * RFC 7386's MergePatch().  Takes ownership of target, which may be NULL
+ * (as json-c represents null), and returns the result, which the caller
+ * owns.  patch is only borrowed.
+ */
+static struct json_object*
+mergePatch( struct json_object* target, struct json_object* patch )
 {
-    char* jstr = NULL;
-    LPErr err = LPAppCopyAll( handle, &jstr );
+    if ( NULL == patch || !json_object_is_type( patch, json_type_object ) ) {
+        if ( NULL != target ) {
+            json_object_put( target );
+        }
+        return NULL == patch ? NULL : json_object_get( patch );
+    }
 
-    if ( LP_ERR_NONE == err )
-    {
-        err = strToJsonWithCheck( jstr, json );
+    if ( NULL == target || !json_object_is_type( target, json_type_object ) ) {
+        if ( NULL != target ) {
+            json_object_put( target );
+        }
+        target = json_object_new_object();
     }
-    g_free( jstr );
-    return err;
-}
 
-static LPErr
-setValueString( LPAppHandle handle, const char* key, const char* jstr )
-{
-        /* Use REPLACE, not INSERT, to avoid duplicates.  */
-    return runSQL( handle, true, NULL, NULL,
-                   "REPLACE INTO data VALUES( \'%q\', \'%q\' );", key, jstr );
+    json_object_object_foreach( patch, name, value ) {
+        if ( NULL == value ) {
+            json_object_object_del( target, name );
+        } else {
+            struct json_object* member = json_object_object_get( target, name );
+            if ( NULL != member ) {
+                json_object_get( member );  /* _add() is about to put it */
+            }
+            json_object_object_add( target, name, mergePatch( member, value ) );
+        }
+    }
+    return target;
 }
 
 LPErr
-LPAppSetValue( LPAppHandle handle, const char* key, const char* const jstr )
+LPAppPatchValue( LPAppHandle handle, const char* key, const char* const patch )
 {
     g_return_val_if_fail( handle != NULL, -EINVAL );
     g_return_val_if_fail( key != NULL, -EINVAL );
-    g_return_val_if_fail( jstr != NULL, -EINVAL );
+    g_return_val_if_fail( patch != NULL, -EINVAL );
 
+    struct json_object* jpatch = json_tokener_parse( patch );
+    struct json_object* target = NULL;
+    StoredValue value = { NULL, false, 0 };
     LPErr err;
-    if ( *key == '\0' ) {       /* empty string? */
+
+    if ( *key == '\0' ) {
         err = LP_ERR_ILLEGALKEY;
-    } else if ( !check_is_json( jstr ) ) {
+    } else if ( is_error( jpatch ) ) {
+        jpatch = NULL;
         err = LP_ERR_VALUENOTJSON;
+    } else if ( ((LPAppHandle_t*)handle)->readOnly ) {
+        err = LP_ERR_READONLY;
     } else {
-        /* Use REPLACE, not INSERT, to avoid duplicates.  */
-        err = setValueString( handle, key, jstr );
+        /* A key that isn't there yet is patched as null */
+        err = copyValueText( handle, key, &value );
+        if ( LP_ERR_NO_SUCH_KEY == err ) {
+            err = LP_ERR_NONE;
+        } else if ( LP_ERR_NONE == err ) {
+            err = strToJsonWithCheck( value.text, &target );
+        }
+    }
+
+    if ( LP_ERR_NONE == err ) {
+        target = mergePatch( target, jpatch );
+        if ( NULL == target || !is_toplevel_json( target ) ) {
+            err = LP_ERR_VALUENOTJSON; /* a patch that isn't an object, say */
+        } else {
+            err = setValueString( handle, key, json_object_to_json_string( target ) );
+        }
+    }
+
+    if ( NULL != target ) {
+        json_object_put( target );
+    }
+    if ( NULL != jpatch ) {
+        json_object_put( jpatch );
     }
+    g_free( value.text );
     return err;
-} /* LPAppSetValue */
+} /* LPAppPatchValue */
+
+LPErr
+LPAppSetValues( LPAppHandle handle, const char* const keys[],
+                const char* const jstrs[], int n )
+{
+    g_return_val_if_fail( handle != NULL, -EINVAL );
+    g_return_val_if_fail( n >= 0, -EINVAL );
+    g_return_val_if_fail( n == 0 || (keys != NULL && jstrs != NULL), -EINVAL );
+
+    LPErr err = LP_ERR_NONE;
+    gchar** normals = g_new0( gchar*, n + 1 );
+    int ii;
+
+    if ( ((LPAppHandle_t*)handle)->readOnly ) {
+        err = LP_ERR_READONLY;
+    }
+
+    /* Check everything before touching the DB... */
+    for ( ii = 0; LP_ERR_NONE == err && ii < n; ++ii ) {
+        if ( NULL == keys[ii] || NULL == jstrs[ii] ) {
+            err = LP_ERR_PARAM_ERR;
+        } else if ( *keys[ii] == '\0' ) {
+            err = LP_ERR_ILLEGALKEY;
+        } else if ( NULL == (normals[ii] = normalize_json( jstrs[ii] )) ) {
+            err = LP_ERR_VALUENOTJSON;
+        }
+    }
+
+    /* ...and use a savepoint so a DB failure part way through doesn't leave
+       half the batch behind in the handle's transaction. */
+    if ( LP_ERR_NONE == err && 0 < n ) {
+        err = runSQL( handle, true, NULL, NULL, "SAVEPOINT setValues;" );
+        if ( LP_ERR_NONE == err ) {
+            for ( ii = 0; LP_ERR_NONE == err && ii < n; ++ii ) {
+                err = setValueString( handle, keys[ii], normals[ii] );
+            }
+            if ( LP_ERR_NONE != err ) {
+                (void)runSQL( handle, false, NULL, NULL, "ROLLBACK TO setValues;" );
+            }
+            (void)runSQL( handle, false, NULL, NULL, "RELEASE setValues;" );
+        }
+    }
+    g_strfreev( normals );
+    return err;
+} /* LPAppSetValues */
 
 LPErr
 LPAppSetValueString( LPAppHandle handle, const char* key, const char* const str )
@@ -740,18 +3055,447 @@ LPAppSetValueCJ( LPAppHandle handle, const char* key, struct json_object* json )
 LPErr
 LPAppRemoveValue( LPAppHandle handle, const char* key )
 {
-    g_return_val_if_fail( handle != NULL, -EINVAL );
+    g_return_val_if_fail( handle != NULL, -EINVAL );
+    g_return_val_if_fail( key != NULL, -EINVAL );
+    LPAppHandle_t* hndl = (LPAppHandle_t*)handle;
+
+    LPErr err = -EINVAL;
+
+    sqlite3_stmt* stmt;
+    err = hndl->readOnly ? LP_ERR_READONLY
+        : getStmt( hndl, STMT_REMOVE_VALUE, &stmt );
+    if ( LP_ERR_NONE == err ) {
+        bindText( stmt, ":key", key );
+        err = stepStmt( hndl, stmt, NULL, NULL );
+        if ( LP_ERR_NONE == err && 0 == sqlite3_changes( hndl->pDb ) )
+        {
+            err = LP_ERR_NO_SUCH_KEY;
+        } else if ( LP_ERR_NONE == err ) {
+            markDirty( hndl );
+        }
+    }
+    return err;
+}
+
+/*
+ * Online backups.  A backup has a connection of its own to the app's DB and
+ * copies it a few pages per LPAppBackupStep() with sqlite3_backup, into a
+ * temporary file renamed over the destination once the copy is complete, so
+ * there's never a torn copy at that path.  Between steps the DB is free for
+ * writers.  In WAL mode the backup's connection holds a read transaction
+ * throughout, which doesn't stop anyone writing and means the copy is of
+ * one consistent state; otherwise that would lock writers out, so a write
+ * from another connection makes sqlite start the copy over instead.
+ */
+/* A write to the source by any other connection sends sqlite3_backup_step()
+ * back to the start, so a busy DB could keep a backup going for ever.  After
+ * this many restarts the rest is copied in one step instead, holding the
+ * read lock for as long as that takes. */
+#define BACKUP_MAX_RESTARTS 4
+
+typedef struct LPAppBackup_t {
+    LPAppHandle_t*  handle;     /* the source */
+    sqlite3*        dest;
+    sqlite3_backup* backup;
+    gchar*          path;
+    gchar*          tmpPath;
+    int             remaining;  /* pages left after the last step, or -1 */
+    int             restarts;
+    bool            done;
+} LPAppBackup_t;
+
+/* Whether the handle's DB is in WAL mode */
+static bool
+isWalMode( sqlite3* db )
+{
+    bool wal = false;
+    sqlite3_stmt* stmt;
+    if ( SQLITE_OK == sqlite3_prepare_v2( db, "PRAGMA journal_mode;", -1, &stmt, NULL ) ) {
+        wal = SQLITE_ROW == sqlite3_step( stmt )
+            && !g_ascii_strcasecmp( (const char*)sqlite3_column_text( stmt, 0 ), "wal" );
+        (void)sqlite3_finalize( stmt );
+    }
+    return wal;
+}
+
+LPErr
+LPAppBackupBegin( const char* appId, const char* path, LPAppBackup* backup )
+{
+    g_return_val_if_fail( backup != NULL, -EINVAL );
+    *backup = NULL;
+    g_return_val_if_fail( appId != NULL, -EINVAL );
+    g_return_val_if_fail( path != NULL, -EINVAL );
+
+    LPAppBackup_t* bkp = g_new0( LPAppBackup_t, 1 );
+    bkp->remaining = -1;
+    LPAppHandle handle;
+    LPErr err = LPAppGetHandle( appId, &handle );
+    if ( LP_ERR_NONE == err ) {
+        bkp->handle = (LPAppHandle_t*)handle;
+        bkp->path = g_strdup( path );
+        bkp->tmpPath = g_strdup_printf( "%s.%d", path, getpid() );
+        err = openConnection( bkp->handle );
+    }
+
+    sqlite3* src = bkp->handle ? bkp->handle->pDb : NULL;
+    if ( LP_ERR_NONE == err && isWalMode( src ) ) {
+        /* the SELECT is what actually starts the read */
+        err = sqlerr_to_lperr( sqlite3_exec( src, "BEGIN; SELECT count(*)"
+                                             " FROM sqlite_master;",
+                                             NULL, NULL, NULL ) );
+    }
+    if ( LP_ERR_NONE == err ) {
+        /* Left by a backup that died.  The copy then has to be a new file:
+           never follow a link someone's put there in the meantime. */
+        (void)unlink( bkp->tmpPath );
+        int fd = open( bkp->tmpPath, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600 );
+        if ( fd < 0 ) {
+            g_critical( "%s: open(%s)=>%s", __func__, bkp->tmpPath, strerror( errno ) );
+            err = LP_ERR_SYSCONFIG;
+            g_free( bkp->tmpPath ); /* not ours to remove */
+            bkp->tmpPath = NULL;
+        } else {
+            close( fd );
+            err = sqlerr_to_lperr( sqlite3_open( bkp->tmpPath, &bkp->dest ) );
+        }
+    }
+    if ( LP_ERR_NONE == err ) {
+        bkp->backup = sqlite3_backup_init( bkp->dest, "main", src, "main" );
+        if ( NULL == bkp->backup ) {
+            fprintf( stderr, "%s: sqlite3_backup_init(%s)=>\"%s\"\n", __func__,
+                     bkp->tmpPath, sqlite3_errmsg( bkp->dest ) );
+            err = sqlerr_to_lperr( sqlite3_errcode( bkp->dest ) );
+        }
+    }
+
+    if ( LP_ERR_NONE == err ) {
+        *backup = (LPAppBackup)bkp;
+    } else {
+        (void)LPAppBackupFinish( (LPAppBackup)bkp );
+    }
+    return err;
+} /* LPAppBackupBegin */
+
+LPErr
+LPAppBackupStep( LPAppBackup backup, int pages, bool* done )
+{
+    g_return_val_if_fail( backup != NULL, -EINVAL );
+    g_return_val_if_fail( pages > 0, -EINVAL );
+    g_return_val_if_fail( done != NULL, -EINVAL );
+
+    LPAppBackup_t* bkp = (LPAppBackup_t*)backup;
+    LPErr err = LP_ERR_NONE;
+    if ( !bkp->done ) {
+        if ( BACKUP_MAX_RESTARTS <= bkp->restarts ) {
+            pages = -1;         /* all of it */
+        }
+        int result = sqlite3_backup_step( bkp->backup, pages );
+        int remaining = sqlite3_backup_remaining( bkp->backup );
+        if ( 0 <= bkp->remaining && remaining > bkp->remaining ) {
+            ++bkp->restarts;
+        }
+        bkp->remaining = remaining;
+        if ( SQLITE_DONE == result ) {
+            bkp->done = true;
+        } else if ( SQLITE_LOCKED == result ) {
+            err = LP_ERR_BUSY;  /* as SQLITE_BUSY: try again later */
+        } else {
+            err = sqlerr_to_lperr( result );
+        }
+    }
+    *done = bkp->done;
+    return err;
+} /* LPAppBackupStep */
+
+LPErr
+LPAppBackupFinish( LPAppBackup backup )
+{
+    g_return_val_if_fail( backup != NULL, -EINVAL );
+
+    LPAppBackup_t* bkp = (LPAppBackup_t*)backup;
+    LPErr err = LP_ERR_NONE;
+    if ( NULL != bkp->backup ) {
+        err = sqlerr_to_lperr( sqlite3_backup_finish( bkp->backup ) );
+    }
+    if ( NULL != bkp->dest ) {
+        LPErr closeErr = sqlerr_to_lperr( sqlite3_close( bkp->dest ) );
+        if ( LP_ERR_NONE == err ) {
+            err = closeErr;
+        }
+    }
+
+    if ( LP_ERR_NONE == err && bkp->done ) {
+        if ( 0 != rename( bkp->tmpPath, bkp->path ) ) {
+            g_critical( "%s: rename(%s)=>%s", __func__, bkp->path, strerror( errno ) );
+            err = LP_ERR_SYSCONFIG;
+        }
+    } else if ( LP_ERR_NONE == err ) {
+        err = LP_ERR_BUSY;      /* abandoned before it was complete */
+    }
+    if ( NULL != bkp->tmpPath ) {
+        (void)unlink( bkp->tmpPath ); /* a no-op once renamed */
+    }
+
+    if ( NULL != bkp->handle ) {
+        if ( NULL != bkp->handle->pDb ) {
+            (void)sqlite3_exec( bkp->handle->pDb, "ROLLBACK;", NULL, NULL, NULL );
+        }
+        (void)LPAppFreeHandle( (LPAppHandle)bkp->handle, false );
+    }
+    g_free( bkp->path );
+    g_free( bkp->tmpPath );
+    g_free( bkp );
+    return err;
+} /* LPAppBackupFinish */
+
+/*
+ * The async API.  Calls are queued for one worker thread, which owns every
+ * handle (and so sqlite connection) they use; each call's callback is then
+ * run from an idle source on the GMainContext it was made with.  The
+ * worker keeps an app's handle open while calls for it keep coming, ends its
+ * transaction after each call, and closes everything once it runs out of
+ * work.
+ */
+typedef enum {
+    ASYNC_COPY_VALUE,
+    ASYNC_COPY_KEYS,
+    ASYNC_COPY_ALL,
+    ASYNC_SET_VALUE,
+    ASYNC_REMOVE_VALUE
+} AsyncKind;
+
+typedef struct AsyncCall {
+    AsyncKind     kind;
+    gchar*        appId;
+    gchar*        key;
+    gchar*        value;        /* in for a set, out for a copy */
+    LPErr         err;
+    GMainContext* context;
+    bool          shared;       /* the settings as of the call, which the */
+    LPDurability  durability;   /* worker's handle for it must have */
+    LPAppValueCallback valueCb;
+    LPAppDoneCallback  doneCb;
+    void*         userData;
+} AsyncCall;
+
+static GAsyncQueue* g_asyncQueue = NULL;
+G_LOCK_DEFINE_STATIC( async );
+
+static void
+asyncCallFree( AsyncCall* call )
+{
+    if ( NULL != call->context ) {
+        g_main_context_unref( call->context );
+    }
+    g_free( call->appId );
+    g_free( call->key );
+    g_free( call->value );
+    g_free( call );
+}
+
+/* Back on the caller's context */
+static gboolean
+asyncDispatch( gpointer data )
+{
+    AsyncCall* call = (AsyncCall*)data;
+    if ( NULL != call->valueCb ) {
+        (*call->valueCb)( call->err, call->value, call->userData );
+    } else if ( NULL != call->doneCb ) {
+        (*call->doneCb)( call->err, call->userData );
+    }
+    asyncCallFree( call );
+    return false;
+}
+
+static LPErr
+asyncRun( LPAppHandle handle, AsyncCall* call )
+{
+    LPErr err = LP_ERR_INTERNAL;
+    switch ( call->kind ) {
+    case ASYNC_COPY_VALUE:
+        err = LPAppCopyValue( handle, call->key, &call->value );
+        break;
+    case ASYNC_COPY_KEYS:
+        err = LPAppCopyKeysWithPrefix( handle, call->key, &call->value );
+        break;
+    case ASYNC_COPY_ALL:
+        err = LPAppCopyAllWithPrefix( handle, call->key, &call->value );
+        break;
+    case ASYNC_SET_VALUE:
+        err = LPAppSetValue( handle, call->key, call->value );
+        break;
+    case ASYNC_REMOVE_VALUE:
+        err = LPAppRemoveValue( handle, call->key );
+        break;
+    }
+    return err;
+}
+
+static void
+asyncFreeHandle( gpointer data )
+{
+    (void)LPAppFreeHandle( (LPAppHandle)data, false ); /* already flushed */
+}
+
+static gpointer
+asyncWorker( gpointer data )
+{
+    GHashTable* handles = g_hash_table_new_full( g_str_hash, g_str_equal,
+                                                 g_free, asyncFreeHandle );
+    for ( ; ; ) {
+        AsyncCall* call = g_async_queue_try_pop( g_asyncQueue );
+        if ( NULL == call ) {
+            g_hash_table_remove_all( handles ); /* idle: close them */
+            call = g_async_queue_pop( g_asyncQueue );
+        }
+
+        LPAppHandle_t* hndl = g_hash_table_lookup( handles, call->appId );
+        if ( NULL != hndl && ( hndl->shared != call->shared
+                               || hndl->durability != call->durability ) ) {
+            g_hash_table_remove( handles, call->appId ); /* settings changed */
+            hndl = NULL;
+        }
+        if ( NULL == hndl ) {
+            hndl = newHandle( call->appId, call->shared, call->durability );
+            g_hash_table_insert( handles, g_strdup( call->appId ), hndl );
+        }
+        LPAppHandle handle = (LPAppHandle)hndl;
+        LPErr err = asyncRun( handle, call );
+
+        /* A commit failure makes a write fail too; a handle that can't end
+           its transaction isn't kept */
+        LPErr flushErr = LPAppFlushHandle( handle, LP_ERR_NONE == err );
+        if ( LP_ERR_NONE != flushErr ) {
+            g_hash_table_remove( handles, call->appId );
+            if ( LP_ERR_NONE == err && ( ASYNC_SET_VALUE == call->kind
+                                         || ASYNC_REMOVE_VALUE == call->kind ) ) {
+                err = flushErr;
+            }
+        }
+        if ( ASYNC_SET_VALUE == call->kind ) {
+            g_free( call->value ); /* the callback doesn't get it back */
+            call->value = NULL;
+        }
+        call->err = err;
+
+        GSource* source = g_idle_source_new();
+        g_source_set_callback( source, asyncDispatch, call, NULL );
+        (void)g_source_attach( source, call->context );
+        g_source_unref( source );
+    }
+    return NULL;
+} /* asyncWorker */
+
+static LPErr
+asyncSubmit( AsyncCall* call, GMainContext* context )
+{
+    LPErr err = LP_ERR_NONE;
+
+    G_LOCK( async );
+    if ( NULL == g_asyncQueue ) {
+#if GLIB_CHECK_VERSION(2,32,0)
+        g_asyncQueue = g_async_queue_new();
+        GThread* thread = g_thread_new( "luna-prefs", asyncWorker, NULL );
+        g_thread_unref( thread );
+#else
+        if ( !g_thread_supported() ) {
+            g_thread_init( NULL );
+        }
+        g_asyncQueue = g_async_queue_new();
+        if ( NULL == g_thread_create( asyncWorker, NULL, FALSE, NULL ) ) {
+            g_async_queue_unref( g_asyncQueue );
+            g_asyncQueue = NULL;
+            err = LP_ERR_INTERNAL;
+        }
+#endif
+    }
+    G_UNLOCK( async );
+
+    if ( LP_ERR_NONE == err ) {
+        call->context = NULL == context ? NULL : g_main_context_ref( context );
+        call->shared = useSharedDB();
+        call->durability = defaultDurability();
+        g_async_queue_push( g_asyncQueue, call );
+    } else {
+        asyncCallFree( call );
+    }
+    return err;
+}
+
+static AsyncCall*
+asyncCallNew( AsyncKind kind, const char* appId, const char* key,
+              void* userData )
+{
+    AsyncCall* call = g_new0( AsyncCall, 1 );
+    call->kind = kind;
+    call->appId = g_strdup( appId );
+    call->key = g_strdup( key );
+    call->userData = userData;
+    return call;
+}
+
+LPErr
+LPAppCopyValueAsync( const char* appId, const char* key, GMainContext* context,
+                     LPAppValueCallback callback, void* userData )
+{
+    g_return_val_if_fail( appId != NULL, -EINVAL );
+    g_return_val_if_fail( key != NULL, -EINVAL );
+    g_return_val_if_fail( callback != NULL, -EINVAL );
+
+    AsyncCall* call = asyncCallNew( ASYNC_COPY_VALUE, appId, key, userData );
+    call->valueCb = callback;
+    return asyncSubmit( call, context );
+}
+
+LPErr
+LPAppCopyKeysAsync( const char* appId, const char* prefix, GMainContext* context,
+                    LPAppValueCallback callback, void* userData )
+{
+    g_return_val_if_fail( appId != NULL, -EINVAL );
+    g_return_val_if_fail( callback != NULL, -EINVAL );
+
+    AsyncCall* call = asyncCallNew( ASYNC_COPY_KEYS, appId, prefix, userData );
+    call->valueCb = callback;
+    return asyncSubmit( call, context );
+}
+
+LPErr
+LPAppCopyAllAsync( const char* appId, const char* prefix, GMainContext* context,
+                   LPAppValueCallback callback, void* userData )
+{
+    g_return_val_if_fail( appId != NULL, -EINVAL );
+    g_return_val_if_fail( callback != NULL, -EINVAL );
+
+    AsyncCall* call = asyncCallNew( ASYNC_COPY_ALL, appId, prefix, userData );
+    call->valueCb = callback;
+    return asyncSubmit( call, context );
+}
+
+LPErr
+LPAppSetValueAsync( const char* appId, const char* key, const char* jstr,
+                    GMainContext* context, LPAppDoneCallback callback,
+                    void* userData )
+{
+    g_return_val_if_fail( appId != NULL, -EINVAL );
+    g_return_val_if_fail( key != NULL, -EINVAL );
+    g_return_val_if_fail( jstr != NULL, -EINVAL );
+
+    AsyncCall* call = asyncCallNew( ASYNC_SET_VALUE, appId, key, userData );
+    call->value = g_strdup( jstr );
+    call->doneCb = callback;
+    return asyncSubmit( call, context );
+}
+
+LPErr
+LPAppRemoveValueAsync( const char* appId, const char* key, GMainContext* context,
+                       LPAppDoneCallback callback, void* userData )
+{
+    g_return_val_if_fail( appId != NULL, -EINVAL );
     g_return_val_if_fail( key != NULL, -EINVAL );
-    LPAppHandle_t* hndl = (LPAppHandle_t*)handle;
-
-    LPErr err = -EINVAL;
 
-    err = runSQL( handle, true, NULL, NULL, "DELETE FROM data WHERE key = \'%q\';", key );
-    if (0 == sqlite3_changes(hndl->pDb))
-    {
-        err = LP_ERR_NO_SUCH_KEY;
-    }
-    return err;
+    AsyncCall* call = asyncCallNew( ASYNC_REMOVE_VALUE, appId, key, userData );
+    call->doneCb = callback;
+    return asyncSubmit( call, context );
 }
 
 /*****************************************************************************
@@ -766,114 +3510,162 @@ LPAppRemoveValue( LPAppHandle handle, const char* key )
    file in /dev/tokens.  Other prefixes are treated as special cases.
  */
 
+/*
+ * The kernel command line can't change until the next boot, so it's read
+ * and split into name => value just once.  A bare word ("quiet") maps to
+ * the empty string; where a name appears twice the first one counts.
+ */
+static GHashTable* g_cmdline = NULL;
+static bool g_cmdlineRead = false;
+G_LOCK_DEFINE_STATIC( cmdline );
+
+/* Caller holds the cmdline lock */
+static GHashTable*
+cmdlineMap( void )
+{
+    if ( !g_cmdlineRead ) {
+        gchar* contents = NULL;
+        if ( g_file_get_contents( "/proc/cmdline", &contents, NULL, NULL ) ) {
+            gchar** words = g_strsplit_set( contents, " \t\n", -1 );
+            gchar** word;
+            g_cmdline = g_hash_table_new_full( g_str_hash, g_str_equal,
+                                               g_free, g_free );
+            for ( word = words; NULL != *word; ++word ) {
+                if ( '\0' != (*word)[0] ) {
+                    gchar* eq = strchr( *word, '=' );
+                    gchar* name = NULL == eq ? g_strdup( *word )
+                        : g_strndup( *word, eq - *word );
+                    if ( NULL == g_hash_table_lookup( g_cmdline, name ) ) {
+                        g_hash_table_insert( g_cmdline, name,
+                                             g_strdup( NULL == eq ? "" : eq + 1 ) );
+                    } else {
+                        g_free( name );
+                    }
+                }
+            }
+            g_strfreev( words );
+            g_free( contents );
+        }
+        g_cmdlineRead = true;   /* failing once means failing every time */
+    }
+    return g_cmdline;
+}
+
 static LPErr
 get_from_cmdline( char** jstr, const char* key )
 {
     LPErr err = LP_ERR_SYSCONFIG;
 
-    FILE* cmdline = fopen( "/proc/cmdline", "r" );
-    if ( NULL != cmdline ) {
-        char buf[4096];
-
-        if ( buf == fgets( buf, sizeof(buf), cmdline ) )
-        {
-            char* token;
-            char* str = buf;
-            char* saveptr;
-            int keylen = strlen( key );
-            while ( NULL != (token = strtok_r( str, " ", &saveptr )) )
-            {
-                if ( 0 == strncmp( key, token, keylen )
-                     && token[keylen] == '=' )
-                {
-                    *jstr = g_strdup( token + keylen + 1 ); /* skip '=' */
-                    err = LP_ERR_NONE;
-                    break;
-                }
-
-                str = NULL;         /* for subsequent strtok_r calls */
-            }
+    G_LOCK( cmdline );
+    GHashTable* map = cmdlineMap();
+    if ( NULL != map ) {
+        const gchar* value = g_hash_table_lookup( map, key );
+        if ( NULL != value ) {
+            *jstr = g_strdup( value );
+            err = LP_ERR_NONE;
+        } else {
+            err = LP_ERR_NO_SUCH_KEY;
         }
-
-        fclose( cmdline );
     }
+    G_UNLOCK( cmdline );
 
     return err;
 }
 
-static LPErr read_machine_type(char** jstr,const char* key)
+/*
+ * nyx.  Opening a device costs far more than asking it something, so each
+ * device is opened the first time it's needed and kept open for as long as
+ * the library's loaded; a device that fails a query is closed so the next
+ * lookup opens it afresh.  All use of nyx is under the one lock.
+ */
+typedef struct NyxProp {
+    const char* token;
+    bool        osInfo;     /* NYX_DEVICE_OS_INFO, else NYX_DEVICE_DEVICE_INFO */
+    int         query;
+} NyxProp;
+
+static const NyxProp g_nyxProps[] = {
+    { PROP_NAME_NDUID,       false, NYX_DEVICE_INFO_NDUID }
+    ,{ PROP_NAME_BOARDTYPE,  false, NYX_DEVICE_INFO_BOARD_TYPE }
+    ,{ INFO_NAME_VERSION,     true, NYX_OS_INFO_CORE_OS_KERNEL_VERSION }
+    ,{ INFO_NAME_BUILDNAME,   true, NYX_OS_INFO_WEBOS_IMAGENAME }
+    ,{ INFO_NAME_BUILDNUMBER, true, NYX_OS_INFO_WEBOS_BUILD_ID }
+};
+
+static bool g_nyxInited = false;
+static nyx_device_handle_t g_nyxDeviceInfo = NULL;
+static nyx_device_handle_t g_nyxOsInfo = NULL;
+G_LOCK_DEFINE_STATIC( nyx );
+
+static const NyxProp*
+findNyxProp( const char* token )
 {
-    nyx_error_t error = NYX_ERROR_GENERIC;
-    nyx_device_handle_t device = NULL;
-    const char *dev_name;
+    unsigned int ii;
+    for ( ii = 0; ii < G_N_ELEMENTS(g_nyxProps); ++ii ) {
+        if ( 0 == strcmp( token, g_nyxProps[ii].token ) ) {
+            return &g_nyxProps[ii];
+        }
+    }
+    return NULL;
+}
 
-    LPErr err = LP_ERR_SYSCONFIG;
-    error = nyx_init();
-    if (NYX_ERROR_NONE == error)
-    {
-        error = nyx_device_open(NYX_DEVICE_DEVICE_INFO, "Main", &device);
+/* Caller holds the nyx lock */
+static nyx_device_handle_t
+nyxDevice( bool osInfo )
+{
+    nyx_device_handle_t* device = osInfo ? &g_nyxOsInfo : &g_nyxDeviceInfo;
 
-        if ((NYX_ERROR_NONE == error) & (NULL != device))
-        {
-            if ( 0 == strncmp( key, "nduid", strlen(key) ))
-            {
-                error = nyx_device_info_query(device, NYX_DEVICE_INFO_NDUID, &dev_name);
-            }
-            else if(0 == strncmp(key,"boardType",strlen(key)))
-            {
-                error = nyx_device_info_query(device, NYX_DEVICE_INFO_BOARD_TYPE, &dev_name);
-            }
-            if (NYX_ERROR_NONE == error)
-            {
-                *jstr = g_strdup(dev_name);
-                err = LP_ERR_NONE;
-            }
-            nyx_device_close(device);
+    if ( !g_nyxInited ) {
+        g_nyxInited = NYX_ERROR_NONE == nyx_init();
+    }
+    if ( g_nyxInited && NULL == *device ) {
+        nyx_device_handle_t opened = NULL;
+        nyx_error_t error = nyx_device_open( osInfo ? NYX_DEVICE_OS_INFO
+                                             : NYX_DEVICE_DEVICE_INFO,
+                                             "Main", &opened );
+        if ( NYX_ERROR_NONE == error ) {
+            *device = opened;
         }
-        nyx_deinit();
     }
-    return err;
+    return *device;
 }
 
-static LPErr read_OS_Info(char **jstr,const char* key)
+/* Caller holds the nyx lock */
+static LPErr
+nyxQuery( const NyxProp* prop, char** jstr )
 {
-    nyx_error_t error = NYX_ERROR_GENERIC;
-    nyx_device_handle_t device = NULL;
-    const char *dev_name;
     LPErr err = LP_ERR_SYSCONFIG;
-    error = nyx_init();
-    if (NYX_ERROR_NONE == error)
-    {
-        error = nyx_device_open(NYX_DEVICE_OS_INFO, "Main", &device);
-        if ((NYX_ERROR_NONE == error) & (NULL != device))
-        {
-            if ( 0 == strncmp( key, "version",strlen(key) ))
-            {
-                error = nyx_os_info_query(device, NYX_OS_INFO_CORE_OS_KERNEL_VERSION, &dev_name);
-            }
-            else if(0 == strncmp(key,"buildNumber",strlen(key)))
-            {
-                error = nyx_os_info_query(device, NYX_OS_INFO_WEBOS_BUILD_ID, &dev_name);
-            }
-            else if(0 == strncmp(key,"buildName",strlen(key)))
-            {
-                error = nyx_os_info_query(device, NYX_OS_INFO_WEBOS_IMAGENAME, &dev_name);
-            }
-            else
-            {
-                error = nyx_device_info_query(device, NYX_OS_INFO_WEBOS_BUILD_ID, &dev_name);
-            }
-            if (NYX_ERROR_NONE == error)
-            {
-                *jstr = g_strdup(dev_name);
-                err = LP_ERR_NONE;
+    nyx_device_handle_t device = nyxDevice( prop->osInfo );
+
+    if ( NULL != device ) {
+        const char* dev_name = NULL;
+        nyx_error_t error = prop->osInfo
+            ? nyx_os_info_query( device, prop->query, &dev_name )
+            : nyx_device_info_query( device, prop->query, &dev_name );
+        if ( NYX_ERROR_NONE == error && NULL != dev_name ) {
+            *jstr = g_strdup( dev_name );
+            err = LP_ERR_NONE;
+        } else {
+            nyx_device_close( device );
+            if ( prop->osInfo ) {
+                g_nyxOsInfo = NULL;
+            } else {
+                g_nyxDeviceInfo = NULL;
             }
-            nyx_device_close(device);
-         }
-         nyx_deinit();
-   }
-   return err;
+        }
+    }
+    return err;
+}
+
+static LPErr
+read_nyx_prop( const NyxProp* prop, char** jstr )
+{
+    G_LOCK( nyx );
+    LPErr err = nyxQuery( prop, jstr );
+    G_UNLOCK( nyx );
+    return err;
 }
+
 static LPErr
 get_from_buildInfo( const char* fileKey, char** jstr )
 {
@@ -915,6 +3707,11 @@ get_from_buildInfo( const char* fileKey, char** jstr )
     return err;
 } /* readBuildInfo */
 
+/* The block device whose size is storageCapacity; NULL for
+ * STORAGE_DEVICE_DEFAULT.  Worked out once, then cached for good. */
+static gchar* g_storageDevice = NULL;
+G_LOCK_DEFINE_STATIC( storageDevice );
+
 static LPErr
 figureDiskCapacity( char** jstr )
 {
@@ -929,28 +3726,81 @@ figureDiskCapacity( char** jstr )
       179     4    7142912 mmcblk0p4
     */
     LPErr err = LP_ERR_SYSCONFIG;
-    /* current format has line ending in mmcblk0, but let's allow for some
-       whitespace should the formatting change. */
-    FILE* file = popen( "grep 'mmcblk0\\s*$' /proc/partitions", "r" );
-    if ( !!file )
-    {
-        int major, minor;
-        long long unsigned nBlocks;
-        char name[64];             /* change format specifiers if sizes changed!! */
-
-        // added 32-bit numeric widths to deal with static analizer
-        int nRead = fscanf( file, "%10d%10d%20llu%63s", &major, &minor, &nBlocks, name );
-        if ( 4 == nRead ) {
-            nBlocks *= 1024;
-            *jstr = g_strdup_printf( "%llu", nBlocks );
+    unsigned long long nBytes = 0;
+    gchar* contents = NULL;
+
+    G_LOCK( storageDevice );
+    gchar* device = g_strdup( NULL == g_storageDevice
+                              ? STORAGE_DEVICE_DEFAULT : g_storageDevice );
+    G_UNLOCK( storageDevice );
+
+    /* sysfs gives the size in 512-byte sectors whatever the device's own */
+    gchar* path = g_strdup_printf( "/sys/block/%s/size", device );
+    if ( g_file_get_contents( path, &contents, NULL, NULL ) ) {
+        char* end;
+        unsigned long long nSectors = g_ascii_strtoull( contents, &end, 10 );
+        if ( end != contents ) {
+            nBytes = nSectors * 512;
             err = LP_ERR_NONE;
         }
+        g_free( contents );
+    }
+    g_free( path );
+
+    if ( LP_ERR_NONE != err ) {
+        /* /proc/partitions gives it in 1K blocks */
+        FILE* file = fopen( "/proc/partitions", "r" );
+        if ( !!file )
+        {
+            char line[128];
+            while ( NULL != fgets( line, sizeof(line), file ) ) {
+                int major, minor;
+                long long unsigned nBlocks;
+                char name[64];             /* change format specifiers if sizes changed!! */
+
+                // added 32-bit numeric widths to deal with static analizer
+                int nRead = sscanf( line, "%10d%10d%20llu%63s", &major, &minor, &nBlocks, name );
+                if ( 4 == nRead && !strcmp( name, device ) ) {
+                    nBytes = nBlocks * 1024;
+                    err = LP_ERR_NONE;
+                    break;
+                }
+            }
+            fclose( file );
+        }
+    }
 
-        pclose( file );
+    if ( LP_ERR_NONE == err ) {
+        *jstr = g_strdup_printf( "%llu", nBytes );
     }
+    g_free( device );
     return err;
 }
 
+LPErr
+LPSystemSetStorageDevice( const char* device )
+{
+    /* a plain device name, since it goes into a path */
+    if ( NULL != device ) {
+        const char* ch;
+        g_return_val_if_fail( '\0' != device[0], -EINVAL );
+        for ( ch = device; '\0' != *ch; ++ch ) {
+            g_return_val_if_fail( g_ascii_isalnum( *ch ) || '_' == *ch || '-' == *ch,
+                                  -EINVAL );
+        }
+    }
+
+    G_LOCK( storageDevice );
+    g_free( g_storageDevice );
+    g_storageDevice = g_strdup( device );
+    G_UNLOCK( storageDevice );
+
+    gchar* key = g_strdup_printf( "%s%s", PALM_TOKEN_PREFIX, PROP_NAME_DISKSIZE );
+    (void)LPSystemCacheInvalidate( key );
+    g_free( key );
+    return LP_ERR_NONE;
+}
+
 static LPErr
 figureDiskFree( char** jstr )
 {
@@ -971,23 +3821,17 @@ figureDiskFree( char** jstr )
 static LPErr
 figurePrevPanic( char** jstr )
 {
-    LPErr err = LP_ERR_SYSCONFIG;
-    bool panic = false;
-
-    FILE* fil = fopen( "/proc/cmdline", "r" );
-    if ( NULL != fil )
-    {
-        char buf[512];
-        if ( NULL != fgets( buf, sizeof(buf), fil ) )
-        {
-            panic = (NULL != strstr( buf, "lastboot=panic" ));
-            err = LP_ERR_NONE;
-        }
+    char* lastboot = NULL;
+    LPErr err = get_from_cmdline( &lastboot, "lastboot" );
+    bool panic = LP_ERR_NONE == err && !strcmp( lastboot, "panic" );
 
-        fclose( fil );
+    if ( LP_ERR_NO_SUCH_KEY == err ) {
+        err = LP_ERR_NONE;
     }
-
-    *jstr = g_strdup( panic? "true" : "false" );
+    if ( LP_ERR_NONE == err ) {
+        *jstr = g_strdup( panic? "true" : "false" );
+    }
+    g_free( lastboot );
     return err;
 }
 
@@ -1077,6 +3921,165 @@ readFromFile( const char* path, char** jstrp )
     return err;
 } /* readFromFile */
 
+/*
+ * The system-property cache.  Working a value out can mean stat()ing and
+ * mapping files, a nyx session or a statfs(), and most never change while
+ * the system's up, so values are kept for as long as their source allows:
+ * for good (SYS_TTL_FOREVER) if they come from the read-only property and
+ * token files, nyx, the partition table or the kernel command line; for
+ * SYS_TTL_FREE_SPACE_MS for the free space; for SYS_TTL_RUNTIME_MS for
+ * anything that could come from LP_RUNTIME_DIR, which anyone can write to at
+ * any time -- including that a key isn't there; and not at all for what
+ * comes from an app DB.  The names in each properties directory are kept
+ * the same way, so listing all the values needn't touch the filesystem
+ * either.  Failures other than "no such key" aren't kept.  Whoever changes
+ * a property can call LPSystemCacheInvalidate() rather than wait.  Once
+ * LPSystemWatchProperties() is watching LP_RUNTIME_DIR there's no need to
+ * expire anything: we hear about every change.
+ */
+#define SYS_TTL_FOREVER      -1
+#define SYS_TTL_NONE          0
+#define SYS_TTL_FREE_SPACE_MS 5000
+#define SYS_TTL_RUNTIME_MS    1000
+
+/* Any key at all can be asked for, and found missing; no more than this
+ * many such answers are kept, so asking for made-up ones can't grow the
+ * cache without bound: reaching it drops them all. */
+#define SYS_CACHE_MAX_MISSES  256
+
+typedef struct SysCacheEntry {
+    LPErr   err;                /* LP_ERR_NONE or LP_ERR_NO_SUCH_KEY */
+    gchar*  value;              /* when err is LP_ERR_NONE */
+    gint64  expires;            /* g_get_monotonic_time(), or 0 for never */
+} SysCacheEntry;
+
+typedef struct SysDirEntry {
+    gchar** names;
+    gint64  expires;
+} SysDirEntry;
+
+static GHashTable* g_sysCache = NULL;   /* key => SysCacheEntry* */
+static guint g_sysCacheMisses = 0;      /* its LP_ERR_NO_SUCH_KEY entries */
+static volatile gboolean g_sysRuntimeWatched = FALSE;
+static bool sysWatchRuntime( void );
+static GHashTable* g_sysDirCache = NULL; /* dir path => SysDirEntry* */
+G_LOCK_DEFINE_STATIC( sysCache );
+
+static void
+sysCacheEntryFree( gpointer data )
+{
+    SysCacheEntry* entry = (SysCacheEntry*)data;
+    if ( LP_ERR_NONE != entry->err ) {
+        --g_sysCacheMisses;     /* under the lock, as all removals are */
+    }
+    g_free( entry->value );
+    g_free( entry );
+}
+
+static void
+sysDirEntryFree( gpointer data )
+{
+    SysDirEntry* entry = (SysDirEntry*)data;
+    g_strfreev( entry->names );
+    g_free( entry );
+}
+
+static gint64
+sysExpiry( gint ttlMs )
+{
+    return SYS_TTL_FOREVER == ttlMs ? 0
+        : g_get_monotonic_time() + (gint64)ttlMs * 1000;
+}
+
+static bool
+sysIsFresh( gint64 expires )
+{
+    return 0 == expires || g_get_monotonic_time() < expires;
+}
+
+static gboolean
+sysCacheIsMiss( gpointer key, gpointer value, gpointer data )
+{
+    return LP_ERR_NONE != ((SysCacheEntry*)value)->err;
+}
+
+static void
+sysCacheStore( const char* key, LPErr err, const char* value, gint ttlMs )
+{
+    SysCacheEntry* entry = g_new0( SysCacheEntry, 1 );
+    entry->err = err;
+    entry->value = LP_ERR_NONE == err ? g_strdup( value ) : NULL;
+    entry->expires = sysExpiry( ttlMs );
+    G_LOCK( sysCache );
+    if ( NULL == g_sysCache ) {
+        g_sysCache = g_hash_table_new_full( g_str_hash, g_str_equal,
+                                            g_free, sysCacheEntryFree );
+    }
+    if ( LP_ERR_NONE != err ) {
+        if ( SYS_CACHE_MAX_MISSES <= g_sysCacheMisses ) {
+            (void)g_hash_table_foreach_remove( g_sysCache, sysCacheIsMiss, NULL );
+        }
+        ++g_sysCacheMisses;
+    }
+    g_hash_table_replace( g_sysCache, g_strdup( key ), entry );
+    G_UNLOCK( sysCache );
+}
+
+static bool
+sysCacheHas( const char* key )
+{
+    G_LOCK( sysCache );
+    SysCacheEntry* entry = NULL == g_sysCache ? NULL
+        : g_hash_table_lookup( g_sysCache, key );
+    bool has = NULL != entry && sysIsFresh( entry->expires );
+    G_UNLOCK( sysCache );
+    return has;
+}
+
+/* Work out the value of token (a key without its PALM_TOKEN_PREFIX) from
+ * scratch, and for how long it can be kept. */
+static LPErr
+figureSystemValue( const char* token, char** jstr, gint* ttlMs )
+{
+    LPErr err = LP_ERR_NO_SUCH_KEY;
+    char* path = NULL;
+    const NyxProp* nyxProp;
+
+    *ttlMs = SYS_TTL_FOREVER;
+    if ( NULL != (path = getTokenPath( token, PROPS_DIR )) )
+    {
+        /* if the file exists, we'll stop the search here, even if an
+         * error is returned.  Might want to think about scenarios and
+         * whether that makes sense.
+        */
+        err = readFromFile( path, jstr );
+    } else if ( NULL != (nyxProp = findNyxProp( token )) ) {
+        err = read_nyx_prop( nyxProp, jstr );
+    } else if ( g_str_has_prefix( token, PROP_PREFIX_CMDLINE ) ) {
+        err = get_from_cmdline( jstr, token + strlen(PROP_PREFIX_CMDLINE) );
+    } else if ( ! strcmp( token, PROP_NAME_DISKSIZE ) ) {
+        err = figureDiskCapacity( jstr );
+    } else if ( ! strcmp( token, PROP_NAME_FREESPACE ) ) {
+        *ttlMs = SYS_TTL_FREE_SPACE_MS;
+        err = figureDiskFree( jstr );
+    } else if ( ! strcmp( token, PROP_NAME_PREVPANIC ) ) {
+        err = figurePrevPanic( jstr );
+    } else if ( ! strcmp( token, PROP_NAME_PREVSHUTCLEAN ) ) {
+        *ttlMs = SYS_TTL_NONE;
+        err = figureShutdownClean( jstr );
+    } else if ( NULL != (path = getTokenPath( token, TOKENS_DIR )) ) {
+        err = readFromFile( path, jstr );
+    } else {
+        /* what's here, or isn't, may change at any moment */
+        *ttlMs = sysWatchRuntime() ? SYS_TTL_FOREVER : SYS_TTL_RUNTIME_MS;
+        if ( NULL != (path = getTokenPath( token, LP_RUNTIME_DIR )) ) {
+            err = readFromFile( path, jstr );
+        }
+    }
+    g_free( path );
+    return err;
+}
+
 LPErr
 LPSystemCopyStringValue( const char* key, char** jstr )
 {
@@ -1091,43 +4094,97 @@ LPSystemCopyStringValue( const char* key, char** jstr )
     }
 
     if ( NULL != token ) {
-        char* path = NULL;
-        if ( NULL != (path = getTokenPath( token, PROPS_DIR )) )
-        {
-            /* if the file exists, we'll stop the search here, even if an
-             * error is returned.  Might want to think about scenarios and
-             * whether that makes sense.
-            */
-            err = readFromFile( path, jstr );
-        } else if ( 0 == strcmp( token, PROP_NAME_NDUID ) ) {
-            err = read_machine_type(jstr,"nduid");
-        } else if ( 0 == strcmp( token, PROP_NAME_BOARDTYPE ) ) {
-            err=read_machine_type(jstr,"boardType");
-        } else if ( ! strcmp( token, INFO_NAME_VERSION ) ) {
-            err=read_OS_Info(jstr,"version");
-        } else if ( ! strcmp( token, INFO_NAME_BUILDNAME ) ) {
-            err=read_OS_Info(jstr,"buildName");
-        } else if ( ! strcmp( token, INFO_NAME_BUILDNUMBER ) ) {
-            err=read_OS_Info(jstr,"buildNumber");
-        } else if ( ! strcmp( token, PROP_NAME_DISKSIZE ) ) {
-            err = figureDiskCapacity( jstr );
-        } else if ( ! strcmp( token, PROP_NAME_FREESPACE ) ) {
-            err = figureDiskFree( jstr );
-        } else if ( ! strcmp( token, PROP_NAME_PREVPANIC ) ) {
-            err = figurePrevPanic( jstr );
-        } else if ( ! strcmp( token, PROP_NAME_PREVSHUTCLEAN ) ) {
-            err = figureShutdownClean( jstr );
-        } else if ( NULL != (path = getTokenPath( token, TOKENS_DIR )) ) {
-            err = readFromFile( path, jstr );
-        } else if ( NULL != (path = getTokenPath( token, LP_RUNTIME_DIR )) ) {
-            err = readFromFile( path, jstr );
+        bool cached = false;
+        G_LOCK( sysCache );
+        SysCacheEntry* entry = NULL == g_sysCache ? NULL
+            : g_hash_table_lookup( g_sysCache, key );
+        if ( NULL != entry && sysIsFresh( entry->expires ) ) {
+            err = entry->err;
+            if ( LP_ERR_NONE == err ) {
+                *jstr = g_strdup( entry->value );
+            }
+            cached = true;
+        }
+        G_UNLOCK( sysCache );
+
+        if ( !cached ) {
+            gint ttlMs;
+            /* not under the lock: figureShutdownClean() goes to a DB */
+            err = figureSystemValue( token, jstr, &ttlMs );
+            if ( SYS_TTL_NONE != ttlMs
+                 && ( LP_ERR_NONE == err || LP_ERR_NO_SUCH_KEY == err ) ) {
+                sysCacheStore( key, err, *jstr, ttlMs );
+            }
         }
-        g_free( path );
     }
 
     return err;
 } /* LPSystemCopyStringValue */
 
+LPErr
+LPSystemCacheInvalidate( const char* key )
+{
+    G_LOCK( sysCache );
+    if ( NULL == key ) {
+        if ( NULL != g_sysCache ) {
+            g_hash_table_remove_all( g_sysCache );
+        }
+        if ( NULL != g_sysDirCache ) {
+            g_hash_table_remove_all( g_sysDirCache );
+        }
+    } else if ( NULL != g_sysCache ) {
+        g_hash_table_remove( g_sysCache, key );
+    }
+    G_UNLOCK( sysCache );
+    return LP_ERR_NONE;
+}
+
+/* Fill the cache with every nyx-backed value it's missing, taking the nyx
+ * lock just once, so listing everything doesn't go to nyx key by key. */
+static void
+sysPrefetchNyx( void )
+{
+    const NyxProp* wanted[G_N_ELEMENTS(g_nyxProps)];
+    unsigned int nWanted = 0;
+    unsigned int ii;
+
+    for ( ii = 0; ii < G_N_ELEMENTS(g_nyxProps); ++ii ) {
+        gchar* key = g_strdup_printf( "%s%s", PALM_TOKEN_PREFIX,
+                                      g_nyxProps[ii].token );
+        if ( !sysCacheHas( key ) ) {
+            /* a file in PROPS_DIR overrides nyx; leave that to the lookup */
+            char* path = getTokenPath( g_nyxProps[ii].token, PROPS_DIR );
+            if ( NULL == path ) {
+                wanted[nWanted++] = &g_nyxProps[ii];
+            }
+            g_free( path );
+        }
+        g_free( key );
+    }
+
+    if ( 0 < nWanted ) {
+        char* values[G_N_ELEMENTS(g_nyxProps)];
+        LPErr errs[G_N_ELEMENTS(g_nyxProps)];
+
+        G_LOCK( nyx );
+        for ( ii = 0; ii < nWanted; ++ii ) {
+            values[ii] = NULL;
+            errs[ii] = nyxQuery( wanted[ii], &values[ii] );
+        }
+        G_UNLOCK( nyx );
+
+        for ( ii = 0; ii < nWanted; ++ii ) {
+            if ( LP_ERR_NONE == errs[ii] ) {
+                gchar* key = g_strdup_printf( "%s%s", PALM_TOKEN_PREFIX,
+                                              wanted[ii]->token );
+                sysCacheStore( key, LP_ERR_NONE, values[ii], SYS_TTL_FOREVER );
+                g_free( key );
+            }
+            g_free( values[ii] );
+        }
+    }
+} /* sysPrefetchNyx */
+
 static LPErr
 LPSystemCopyKeys_impl( char** jstr, bool onPublicBus )
 {
@@ -1173,27 +4230,246 @@ LPSystemCopyKeysPublicCJ( struct json_object** json )
     return LPSystemCopyKeysCJ_impl( json, true );
 }
 
+/* The names of the files in dirpath, from the system-property cache if it
+ * has them.  Caller must g_strfreev. */
+static gchar**
+copyDirTokens( const char* dirpath )
+{
+    gchar** names = NULL;
+    G_LOCK( sysCache );
+    SysDirEntry* entry = NULL == g_sysDirCache ? NULL
+        : g_hash_table_lookup( g_sysDirCache, dirpath );
+    if ( NULL != entry && sysIsFresh( entry->expires ) ) {
+        names = g_strdupv( entry->names );
+    }
+    G_UNLOCK( sysCache );
+
+    if ( NULL == names ) {
+        /* before reading, so no change goes unheard once we're watching */
+        bool watched = 0 != strcmp( dirpath, LP_RUNTIME_DIR ) || sysWatchRuntime();
+        GPtrArray* found = g_ptr_array_new();
+        GDir *dir = g_dir_open( dirpath, 0, NULL );
+        while ( !!dir )
+        {
+            const gchar* name = g_dir_read_name( dir );
+            if ( !name ) {
+                break;
+            }
+            g_ptr_array_add( found, g_strdup( name ) );
+        }
+        if ( NULL != dir ) { /* glib docs say NULL is ok, but code asserts !NULL */
+            g_dir_close( dir );
+        }
+        g_ptr_array_add( found, NULL );
+        names = (gchar**)g_ptr_array_free( found, FALSE );
+
+        entry = g_new0( SysDirEntry, 1 );
+        entry->names = g_strdupv( names );
+        entry->expires = sysExpiry( watched ? SYS_TTL_FOREVER : SYS_TTL_RUNTIME_MS );
+        G_LOCK( sysCache );
+        if ( NULL == g_sysDirCache ) {
+            g_sysDirCache = g_hash_table_new_full( g_str_hash, g_str_equal,
+                                                   g_free, sysDirEntryFree );
+        }
+        g_hash_table_replace( g_sysDirCache, g_strdup( dirpath ), entry );
+        G_UNLOCK( sysCache );
+    }
+    return names;
+}
+
+/*
+ * Watching the properties directories.  Any change to a file drops the
+ * cached value of the key it's named for, and a file coming or going drops
+ * the cached list of the directory's files too; nothing else is touched.
+ * A directory that goes away takes its watch with it, so everything cached
+ * is dropped then.  LP_RUNTIME_DIR, which is made on demand, is watched
+ * whenever it's found to be there and isn't already; until then its values
+ * expire as they would with no watching at all.
+ */
+enum { WATCH_PROPS, WATCH_TOKENS, WATCH_RUNTIME, WATCH_COUNT };
+static const char* g_watchedDirs[WATCH_COUNT] = {
+    [WATCH_PROPS]   = PROPS_DIR,
+    [WATCH_TOKENS]  = TOKENS_DIR,
+    [WATCH_RUNTIME] = LP_RUNTIME_DIR,
+};
+static int g_watchDescriptors[WATCH_COUNT] = { -1, -1, -1 };
+static int g_watchFd = -1;
+G_LOCK_DEFINE_STATIC( watch );
+
+#define WATCH_MASK ( IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE \
+                     | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF )
+
+/* Caller holds the watch lock.  Watch directory ii if it isn't already and
+ * it's there; returns whether it's watched now. */
+static bool
+watchAdd( int ii )
+{
+    if ( g_watchDescriptors[ii] < 0 && 0 <= g_watchFd ) {
+        g_watchDescriptors[ii] = inotify_add_watch( g_watchFd, g_watchedDirs[ii],
+                                                    WATCH_MASK );
+        if ( WATCH_RUNTIME == ii ) {
+            g_sysRuntimeWatched = 0 <= g_watchDescriptors[ii];
+        }
+    }
+    return 0 <= g_watchDescriptors[ii];
+}
+
+/* Whether changes to LP_RUNTIME_DIR will be heard about, watching it now
+ * if it's turned up since we last looked.  Nothing cached needs dropping
+ * when it does: what was cached without a watch expires anyway. */
+static bool
+sysWatchRuntime( void )
+{
+    bool watched = g_sysRuntimeWatched;
+    if ( !watched ) {
+        G_LOCK( watch );
+        watched = watchAdd( WATCH_RUNTIME );
+        G_UNLOCK( watch );
+    }
+    return watched;
+}
+
+static void
+sysCacheForgetDir( const char* dirpath )
+{
+    G_LOCK( sysCache );
+    if ( NULL != g_sysDirCache ) {
+        g_hash_table_remove( g_sysDirCache, dirpath );
+    }
+    G_UNLOCK( sysCache );
+}
+
+/* The index of the directory watched with wd, or WATCH_COUNT */
+static int
+watchIndex( int wd )
+{
+    int ii;
+    for ( ii = 0; ii < WATCH_COUNT; ++ii ) {
+        if ( g_watchDescriptors[ii] == wd ) {
+            break;
+        }
+    }
+    return ii;
+}
+
+static gboolean
+watchFunc( GIOChannel* channel, GIOCondition condition, gpointer data )
+{
+    /* enough for a few events, and at least one of any size */
+    char buf[4 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    int fd = g_io_channel_unix_get_fd( channel );
+    ssize_t len = read( fd, buf, sizeof(buf) );
+    ssize_t offset = 0;
+
+    while ( offset < len ) {
+        const struct inotify_event* event = (const struct inotify_event*)(buf + offset);
+        if ( event->mask & IN_Q_OVERFLOW ) {
+            (void)LPSystemCacheInvalidate( NULL ); /* we've lost track */
+        } else if ( event->mask & IN_MOVE_SELF ) {
+            /* the watch follows it to where it's no use; IN_IGNORED next */
+            (void)inotify_rm_watch( fd, event->wd );
+        } else if ( event->mask & IN_IGNORED ) {
+            /* The directory's gone (or moved), and its watch with it.  Try
+               again in case it's back already; what was cached from it
+               can't be trusted in any case. */
+            G_LOCK( watch );
+            int ii = watchIndex( event->wd );
+            if ( ii < WATCH_COUNT ) {
+                g_watchDescriptors[ii] = -1;
+                if ( WATCH_RUNTIME == ii ) {
+                    g_sysRuntimeWatched = FALSE;
+                }
+                (void)watchAdd( ii );
+            }
+            G_UNLOCK( watch );
+            (void)LPSystemCacheInvalidate( NULL );
+        } else if ( 0 < event->len ) {
+            gchar* key = g_strdup_printf( "%s%s", PALM_TOKEN_PREFIX, event->name );
+            (void)LPSystemCacheInvalidate( key );
+            g_free( key );
+
+            if ( event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) ) {
+                G_LOCK( watch );
+                int ii = watchIndex( event->wd );
+                G_UNLOCK( watch );
+                if ( ii < WATCH_COUNT ) {
+                    sysCacheForgetDir( g_watchedDirs[ii] );
+                }
+            }
+        }
+        offset += sizeof(struct inotify_event) + event->len;
+    }
+
+    if ( len < 0 && EINTR != errno && EAGAIN != errno ) {
+        g_critical( "%s: read=>%s; no longer watching", __func__, strerror( errno ) );
+        G_LOCK( watch );
+        g_watchFd = -1;         /* the channel closes it */
+        g_sysRuntimeWatched = FALSE;
+        G_UNLOCK( watch );
+        (void)LPSystemCacheInvalidate( NULL );
+        return FALSE;
+    }
+    return TRUE;
+}
+
+LPErr
+LPSystemWatchProperties( GMainContext* context )
+{
+    static bool s_watching = false;
+    if ( s_watching ) {
+        return LP_ERR_NONE;
+    }
+
+    LPErr err = LP_ERR_SYSCONFIG;
+    int fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+    if ( 0 <= fd ) {
+        int ii;
+        bool any = false;
+        G_LOCK( watch );
+        g_watchFd = fd;
+        for ( ii = 0; ii < WATCH_COUNT; ++ii ) {
+            any = watchAdd( ii ) || any;
+        }
+        G_UNLOCK( watch );
+
+        GIOChannel* channel = g_io_channel_unix_new( fd );
+        g_io_channel_set_close_on_unref( channel, TRUE );
+        GSource* source = g_io_create_watch( channel, G_IO_IN );
+        g_source_set_callback( source, (GSourceFunc)watchFunc, NULL, NULL );
+        (void)g_source_attach( source, context );
+        g_source_unref( source );
+        g_io_channel_unref( channel );  /* the source has it */
+
+        s_watching = true;
+        /* What's cached from before may be stale, and may now last */
+        (void)LPSystemCacheInvalidate( NULL );
+        if ( any ) {
+            err = LP_ERR_NONE;
+        }
+    }
+    if ( LP_ERR_NONE != err ) {
+        g_warning( "%s: can't watch the properties directories", __func__ );
+    }
+    return err;
+} /* LPSystemWatchProperties */
+
 static LPErr
 for_each_dir_token( const char* dirpath,
                     LPErr (*proc)( const gchar* name, bool onPublicBus, void* closure ),
                     bool onPublicBus, void* closure )
 {
     LPErr err = LP_ERR_NONE;
-    GDir *dir = g_dir_open( dirpath, 0, NULL );
-    while ( !!dir )
+    gchar** names = copyDirTokens( dirpath );
+    gchar** name;
+    for ( name = names; NULL != *name; ++name )
     {
-        const gchar* name = g_dir_read_name( dir );
-        if ( !name ) {
-            break;
-        }
-        err = (*proc)( name, onPublicBus, closure );
+        err = (*proc)( *name, onPublicBus, closure );
         if ( LP_ERR_NONE != err ) {
             break;
         }
     }
-    if ( NULL != dir ) { /* glib docs say NULL is ok, but code asserts !NULL */
-        g_dir_close( dir );
-    }
+    g_strfreev( names );
     return err;
 }
 
@@ -1376,6 +4652,8 @@ LPSystemCopyAllCJ_impl( struct json_object** json, bool onPublicBus )
     int ii;
     struct json_object* array = json_object_new_array();
 
+    sysPrefetchNyx();
+
     err = for_each_dir_token( PROPS_DIR, addValToArray, onPublicBus, array );
     if ( LP_ERR_NONE == err ) {
         err = for_each_dir_token( TOKENS_DIR, addValToArray, onPublicBus, array );
@@ -1557,6 +4835,12 @@ LPErrorString( LPErr err, char** str )
     case LP_ERR_DBERROR:
         msg = "unspecified sqlite3 error";
         break;
+    case LP_ERR_READONLY:
+        msg = "handle is read-only";
+        break;
+    case LP_ERR_VERSION_MISMATCH:
+        msg = "value has changed since that version";
+        break;
     }
 
     if ( !msg ) {
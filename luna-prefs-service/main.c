@@ -57,9 +57,15 @@
  * - \ref com_palm_preferences_app_properties_get_app_keys_obj
  * - \ref com_palm_preferences_app_properties_get_all_app_properties
  * - \ref com_palm_preferences_app_properties_get_all_app_properties_obj
+ * - \ref com_palm_preferences_app_properties_get_app_changes
  * - \ref com_palm_preferences_app_properties_get_app_property
+ * - \ref com_palm_preferences_app_properties_get_some_app_properties
  * - \ref com_palm_preferences_app_properties_set_app_property
+ * - \ref com_palm_preferences_app_properties_set_app_properties
+ * - \ref com_palm_preferences_app_properties_merge_app_property
  * - \ref com_palm_preferences_app_properties_remove_app_property
+ * - \ref com_palm_preferences_app_properties_cas_app_property
+ * - \ref com_palm_preferences_app_properties_backup_app_properties
  *
  */
 
@@ -68,11 +74,48 @@ static int sLogLevel = G_LOG_LEVEL_MESSAGE;
 static bool sUseSyslog = false;
 #define EXIT_TIMER_SECONDS 30
 
+/* App DB handles are kept open between requests, most recently used first,
+ * for at most this many apps.  They're all closed once the service has been
+ * idle for APP_POOL_IDLE_SECONDS.
+ */
+#define APP_POOL_SIZE 8
+#define APP_POOL_IDLE_SECONDS 10
+
+/* The DBs of apps written to are tidied up (see LPAppMaintain()) this long
+ * before the service would quit for being idle, one per idle moment.
+ */
+#define APP_MAINTAIN_LEAD_SECONDS 5
+
+/* Default size of libluna-prefs' value cache, which saves going to the DB for
+ * the app properties asked for over and over.  See -k.
+ */
+#define APP_CACHE_KBYTES 256
+
+/* Writes to an app are held for up to this long so that a burst of them
+ * shares one commit (see -w), but no more than APP_WRITE_BATCH_MAX at a time.
+ */
+#define APP_WRITE_WINDOW_MS 20
+#define APP_WRITE_BATCH_MAX 64
+
+/* Backups copy this many pages of an app's DB each time the main loop is
+ * otherwise idle, and wait this long before retrying one whose DB is busy.
+ */
+#define APP_BACKUP_PAGES 16
+#define APP_BACKUP_RETRY_MS 100
+
+/* Backups go here and nowhere else: we're root, and would otherwise write
+ * over any file a caller named. */
+#define APP_BACKUP_DIR "/var/backups/preferences"
+
 #define FREE_IF_SET(lserrp)                     \
     if ( LSErrorIsSet( lserrp ) ) {             \
         LSErrorFree( lserrp );                  \
     }
 
+static void pool_drain( void );
+static bool subscriptions_live( void );
+static void reset_timer( void );
+
 static void
 term_handler( int signal )
 {
@@ -83,10 +126,57 @@ static gboolean
 sourceFunc( gpointer data )
 {
     g_debug( "%s()", __func__ );
-    g_main_loop_quit( g_mainloop );
+    pool_drain();
+    /* Quitting would drop subscribers without a word; wait them out */
+    if ( subscriptions_live() ) {
+        reset_timer();
+    } else {
+        g_main_loop_quit( g_mainloop );
+    }
+    return false;
+}
+
+static gboolean
+poolIdleFunc( gpointer data )
+{
+    g_debug( "%s()", __func__ );
+    pool_drain();
     return false;
 }
 
+static void
+reset_pool_timer( void )
+{
+    static GSource* s_source = NULL;
+
+    if ( NULL != s_source ) {
+        g_source_destroy( s_source );
+        g_source_unref( s_source );
+    }
+
+    s_source = g_timeout_source_new_seconds( APP_POOL_IDLE_SECONDS );
+    g_source_set_callback( s_source, poolIdleFunc, NULL, NULL );
+    (void)g_source_attach( s_source, NULL );
+}
+
+static gboolean maintainTimerFunc( gpointer data );
+
+static void
+reset_maintain_timer( void )
+{
+    static GSource* s_source = NULL;
+
+    if ( NULL != s_source ) {
+        g_source_destroy( s_source );
+        g_source_unref( s_source );
+    }
+
+    s_source = g_timeout_source_new_seconds( EXIT_TIMER_SECONDS
+                                             - APP_MAINTAIN_LEAD_SECONDS );
+    g_source_set_callback( s_source, maintainTimerFunc, NULL, NULL );
+    (void)g_source_attach( s_source, NULL );
+}
+
 static void
 reset_timer( void )
 {
@@ -100,6 +190,9 @@ reset_timer( void )
     s_source = g_timeout_source_new_seconds( EXIT_TIMER_SECONDS );
     g_source_set_callback( s_source, sourceFunc, NULL, NULL );
     (void)g_source_attach( s_source, NULL );
+
+    reset_pool_timer();
+    reset_maintain_timer();
 }
 
 
@@ -214,9 +307,10 @@ replyWithValue( LSHandle* sh, LSMessage* message, LSError* lserror,
     return LSMessageReply( sh, message, value, lserror );
 } /* replyWithValue */
 
-static bool
-replyWithKeyValue( LSHandle* sh, LSMessage* message, LSError* lserror,
-                   const gchar* key, const gchar* value )
+/* {key: value, returnValue: true}, adding "version" unless version is NULL.
+ * Caller must g_free. */
+static gchar*
+keyValueReplyText( const gchar* key, const gchar* value, const long long* version )
 {
     g_assert( !!value );
     struct json_object* jsonVal = json_tokener_parse( value );
@@ -240,15 +334,27 @@ replyWithKeyValue( LSHandle* sh, LSMessage* message, LSError* lserror,
     g_assert( !!result );
     g_assert( !!key );
     json_object_object_add( result, key, jsonVal );
+    if ( NULL != version ) {
+        json_object_object_add( result, "version",
+                                json_object_new_int64( *version ) );
+    }
 
     add_true_result( result );
 
-    const char* text = json_object_to_json_string( result );
+    gchar* text = g_strdup( json_object_to_json_string( result ) );
     g_assert( !!text );
-    bool success = replyWithValue( sh, message, lserror, text );
-
     json_object_put( result );
 
+    return text;
+} /* keyValueReplyText */
+
+static bool
+replyWithKeyValue( LSHandle* sh, LSMessage* message, LSError* lserror,
+                   const gchar* key, const gchar* value, const long long* version )
+{
+    gchar* text = keyValueReplyText( key, value, version );
+    bool success = replyWithValue( sh, message, lserror, text );
+    g_free( text );
     return success;
 } /* replyWithKeyValue */
 
@@ -919,7 +1025,8 @@ Get a system property.
 }
 \endcode
 
-\param key Name of the property.
+\param key Name of the property.  \c com.palm.properties.cmdline.<name> is the
+value given \c <name> on the kernel command line ("" if it's given none).
 
 \subsection com_palm_preferences_system_properties_get_sys_property_returns Returns:
 \code
@@ -974,7 +1081,7 @@ sysGetValue( LSHandle* sh, LSMessage* message, void* user_data )
             if ( LP_ERR_NONE == err && NULL != value ) {
                 LSError lserror;
                 LSErrorInit( &lserror );
-                if ( !replyWithKeyValue( sh, message, &lserror, key, value ) ) {
+                if ( !replyWithKeyValue( sh, message, &lserror, key, value, NULL ) ) {
                     LSErrorPrint( &lserror, stderr );
                     /* TODO: how do we report this error?  We just failed to
                        reply, so attempting to reply with the error from that
@@ -1012,157 +1119,756 @@ static LSMethod sysPropGetMethods[] = {
    { },
 };
 
-typedef LPErr (*AppGetter)( LPAppHandle handle, struct json_object** json );
+/*
+ * The pool of open app handles.  Hot apps (settings, the launcher...) hit
+ * the same handful of DBs over and over, and reopening one costs a mkdir,
+ * an open and a close on top of the transaction itself.  Handles taken from
+ * the pool must be given back with pool_release_handle(), which ends their
+ * transaction but leaves the DB open.
+ */
+typedef struct PooledHandle {
+    gchar*      appId;
+    LPAppHandle handle;
+} PooledHandle;
 
-static bool
-appGet_internal( LSHandle* sh, LSMessage* message, AppGetter getter, bool asObj )
-{
-    LPErr err = LP_ERR_NONE;
-    gchar* appId = NULL;
-    struct json_object* json = NULL;
-    LPAppHandle handle = NULL;
+static GHashTable* sPool = NULL;        /* appId -> PooledHandle* */
+static GQueue sPoolLRU = G_QUEUE_INIT;  /* of PooledHandle*, most recent first */
 
-    if ( parseMessage( message,
-                       "appId", json_type_string, &appId,
-                       NULL ) ) {
-        err = LPAppGetHandle( appId, &handle );
-        if ( 0 != err ) goto error;
+static void write_flush_app( const char* appId );
+static void write_flush_all( void );
 
-        err = (*getter)( handle, &json );
-        if ( 0 != err ) goto error;
+static void
+pool_free_entry( PooledHandle* entry )
+{
+    LPErr err = LPAppCheckpoint( entry->handle );
+    if ( LP_ERR_NONE != err ) {
+        g_debug( "%s: checkpoint of %s=>%d", __func__, entry->appId, err );
+    }
+    (void)LPAppFreeHandle( entry->handle, false );
+    g_free( entry->appId );
+    g_free( entry );
+}
 
-        if ( asObj ) {
-            json = wrapArray( json );
-        }
+static void
+pool_remove_entry( PooledHandle* entry )
+{
+    g_queue_remove( &sPoolLRU, entry );
+    g_hash_table_remove( sPool, entry->appId );
+    pool_free_entry( entry );
+}
 
-        LSError lserror;
-        LSErrorInit( &lserror );
+static LPErr
+pool_get_handle( const char* appId, LPAppHandle* handle )
+{
+    LPErr err = LP_ERR_NONE;
 
-        if ( !LSMessageReply( sh, message,
-                              json_object_to_json_string(json),
-                              &lserror ) ) {
-            LSErrorPrint( &lserror, stderr );
-        }
-        FREE_IF_SET (&lserror);
-    } else {
-        errorReplyStr( sh, message, "no appId parameter found" );
+    if ( NULL == sPool ) {
+        sPool = g_hash_table_new( g_str_hash, g_str_equal );
     }
 
- error:
-    errorReplyErr( sh, message, err );
-    if ( !!handle ) {
-        (void)LPAppFreeHandle( handle, FALSE );
+    /* A handle whose DB has been cleared out from under it would write to
+       a file that's gone; drop it before anything (queued writes included)
+       gets to use it. */
+    PooledHandle* entry = g_hash_table_lookup( sPool, appId );
+    bool stale = false;
+    if ( NULL != entry
+         && ( LP_ERR_NONE != LPAppHandleIsStale( entry->handle, &stale ) || stale ) ) {
+        g_debug( "%s: %s's DB was cleared; reopening", __func__, appId );
+        pool_remove_entry( entry );
     }
-    g_free( appId );
-    json_object_put( json );
 
-    return true;
-} /* appGetKeys */
+    /* Whatever the handle's wanted for, it mustn't miss queued writes */
+    write_flush_app( appId );
 
-/*!
-\page com_palm_preferences_app_properties
-\n
-\section com_palm_preferences_app_properties_get_app_keys getAppKeys
+    entry = g_hash_table_lookup( sPool, appId );
+    if ( NULL != entry ) {
+        g_queue_remove( &sPoolLRU, entry );
+    } else {
+        LPAppHandle newHandle;
+        err = LPAppGetHandle( appId, &newHandle );
+        if ( LP_ERR_NONE == err ) {
+            entry = g_new0( PooledHandle, 1 );
+            entry->appId = g_strdup( appId );
+            entry->handle = newHandle;
+            g_hash_table_insert( sPool, entry->appId, entry );
+
+            if ( g_queue_get_length( &sPoolLRU ) >= APP_POOL_SIZE ) {
+                pool_remove_entry( g_queue_peek_tail( &sPoolLRU ) );
+            }
+        }
+    }
 
-\e Public.
+    if ( NULL != entry ) {
+        g_queue_push_head( &sPoolLRU, entry );
+        *handle = entry->handle;
+    }
+    return err;
+} /* pool_get_handle */
 
-com.palm.preferences/appProperties/getAppKeys
+/* End the handle's transaction.  A handle we can't do that with is in no
+ * shape to be reused, so it's dropped from the pool (and rolled back). */
+static LPErr
+pool_release_handle( const char* appId, LPAppHandle handle, bool commit )
+{
+    LPErr err = LPAppFlushHandle( handle, commit );
+    if ( LP_ERR_NONE != err ) {
+        PooledHandle* entry = g_hash_table_lookup( sPool, appId );
+        g_assert( NULL != entry && entry->handle == handle );
+        pool_remove_entry( entry );
+    }
+    return err;
+}
 
-Get all property keys for an application as a string array.
+static void
+pool_drain( void )
+{
+    PooledHandle* entry;
+    write_flush_all();
+    while ( NULL != (entry = g_queue_pop_head( &sPoolLRU )) ) {
+        g_hash_table_remove( sPool, entry->appId );
+        pool_free_entry( entry );
+    }
+}
 
-\subsection com_palm_preferences_app_properties_get_app_keys_syntax Syntax:
-\code
+/*
+ * Idle-time maintenance.  Apps whose DBs have been written to are noted, and
+ * when the service has been idle long enough that it's about to quit, each
+ * gets an LPAppMaintain() pass -- compacting what removals freed, and the
+ * like -- from a low-priority idle source, so a request arriving meanwhile
+ * waits for one app's at most.  With every app in the shared DB only the
+ * first pass does any work: LPAppMaintain() skips a DB that hasn't changed
+ * since its last.
+ */
+static GHashTable* sMaintainApps = NULL; /* appId => itself */
+
+static void
+maintain_mark( const char* appId )
 {
-    "appId": string
+    if ( NULL == sMaintainApps ) {
+        sMaintainApps = g_hash_table_new_full( g_str_hash, g_str_equal,
+                                               g_free, NULL );
+    }
+    gchar* key = g_strdup( appId );
+    g_hash_table_replace( sMaintainApps, key, key );
 }
-\endcode
 
-\param appId Id for the application.
+static gboolean
+maintainIdleFunc( gpointer data )
+{
+    GHashTableIter iter;
+    gpointer appId = NULL;
+    if ( NULL != sMaintainApps ) {
+        g_hash_table_iter_init( &iter, sMaintainApps );
+        if ( !g_hash_table_iter_next( &iter, &appId, NULL ) ) {
+            appId = NULL;
+        }
+    }
 
-\subsection com_palm_preferences_app_properties_get_app_keys_returns_succesful Returns with a succesful call:
-\code
-[ string array ]
-\endcode
+    if ( NULL != appId ) {
+        g_hash_table_iter_steal( &iter );
+        LPAppHandle handle;
+        LPErr err = pool_get_handle( appId, &handle );
+        if ( LP_ERR_NONE == err ) {
+            err = pool_release_handle( appId, handle, false );
+        }
+        if ( LP_ERR_NONE == err ) {
+            err = LPAppMaintain( handle, 0 );
+        }
+        g_debug( "%s: %s=>%d", __func__, (gchar*)appId, err );
+        g_free( appId );
+    }
+    return NULL != appId;       /* again, until there's none left */
+}
 
-\subsection com_palm_preferences_app_properties_get_app_keys_returns_failure Returns with a failed call:
-\code
+static gboolean
+maintainTimerFunc( gpointer data )
 {
-    "returnValue": boolean,
-    "errorText": string
+    if ( NULL != sMaintainApps && 0 < g_hash_table_size( sMaintainApps ) ) {
+        g_idle_add_full( G_PRIORITY_LOW, maintainIdleFunc, NULL, NULL );
+    }
+    return false;
 }
-\endcode
-
-\param returnValue Indicates if the call was succesful, i.e. always false in this situation.
-\param errorText Describes the error.
 
-\subsection com_palm_preferences_app_properties_get_app_keys_examples Examples:
-\code
-luna-send -n 1 -f luna://com.palm.preferences/appProperties/getAppKeys '{"appId": "com.palm.app.calendar"}'
-\endcode
+/*
+ * Subscriptions.  A getAppProperty subscriber is filed under
+ * "getAppProperty:<appId>/<key>" and a getAllAppProperties one under
+ * "getAllAppProperties:<appId>", so a committed change finds exactly the
+ * calls watching it with one lookup per key, and costs nothing more when
+ * there are none.  Each is sent what its original call would return now.
+ */
+static gchar*
+subscription_key( const char* method, const char* appId, const char* key )
+{
+    return NULL == key ? g_strdup_printf( "%s:%s", method, appId )
+        : g_strdup_printf( "%s:%s/%s", method, appId, key );
+}
 
-Example response for a succesful call:
-\code
-[
-    "aKey",
-    "anotherKey"
-]
-\endcode
+/* The keys anyone's subscribed under, by bus: LSHandle* => set of keys.
+ * Subscribers going away isn't reported, so a key stays until
+ * subscriptions_live() finds no one under it. */
+static GHashTable* sSubKeys = NULL;
 
-Example response for a failed call:
-\code
+/* If the caller asked to subscribe, file message under the key for method */
+static void
+subscription_add( LSHandle* sh, LSMessage* message, const char* method,
+                  const char* appId, const char* key )
 {
-    "returnValue": false,
-    "errorText": "no appId parameter found"
+    if ( LSMessageIsSubscription( message ) ) {
+        gchar* subKey = subscription_key( method, appId, key );
+        LSError lserror;
+        LSErrorInit( &lserror );
+        if ( LSSubscriptionAdd( sh, subKey, message, &lserror ) ) {
+            if ( NULL == sSubKeys ) {
+                sSubKeys = g_hash_table_new_full( g_direct_hash, g_direct_equal, NULL,
+                                                  (GDestroyNotify)g_hash_table_destroy );
+            }
+            GHashTable* keys = g_hash_table_lookup( sSubKeys, sh );
+            if ( NULL == keys ) {
+                keys = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, NULL );
+                g_hash_table_insert( sSubKeys, sh, keys );
+            }
+            g_hash_table_replace( keys, subKey, subKey );
+            subKey = NULL;      /* keys has it */
+        } else {
+            LSErrorPrint( &lserror, stderr );
+        }
+        FREE_IF_SET( &lserror );
+        g_free( subKey );
+    }
 }
-\endcode
-*/
+
+/* Whether anyone is still subscribed to anything, forgetting the keys no
+ * one is. */
 static bool
-appGetKeys( LSHandle* sh, LSMessage* message, void* user_data )
-{
-    reset_timer();
-    g_debug( "%s(%s)", __func__, LSMessageGetPayload(message) );
-    return appGet_internal( sh, message, LPAppCopyKeysCJ, false );
+subscriptions_live( void )
+{
+    bool live = false;
+    GHashTableIter busIter;
+    gpointer sh, keys;
+
+    if ( NULL != sSubKeys ) {
+        g_hash_table_iter_init( &busIter, sSubKeys );
+        while ( g_hash_table_iter_next( &busIter, &sh, &keys ) ) {
+            GHashTableIter keyIter;
+            gpointer subKey;
+            g_hash_table_iter_init( &keyIter, (GHashTable*)keys );
+            while ( g_hash_table_iter_next( &keyIter, &subKey, NULL ) ) {
+                LSSubscriptionIter* iter = NULL;
+                LSError lserror;
+                LSErrorInit( &lserror );
+                bool any = LSSubscriptionAcquire( (LSHandle*)sh, subKey, &iter, &lserror )
+                    && LSSubscriptionHasNext( iter );
+                if ( NULL != iter ) {
+                    LSSubscriptionRelease( iter );
+                }
+                FREE_IF_SET( &lserror );
+                if ( any ) {
+                    live = true;
+                } else {
+                    g_hash_table_iter_remove( &keyIter );
+                }
+            }
+        }
+    }
+    return live;
 }
 
-/*!
-\page com_palm_preferences_app_properties
-\n
-\section com_palm_preferences_app_properties_get_app_keys_obj getAppKeysObj
+/* Tell getAppProperty subscribers to appId/key about its value now */
+static void
+notify_key( LSHandle* sh, LPAppHandle handle, const char* appId, const char* key )
+{
+    gchar* subKey = subscription_key( "getAppProperty", appId, key );
+    LSSubscriptionIter* iter = NULL;
+    LSError lserror;
+    LSErrorInit( &lserror );
 
-\e Public.
+    if ( LSSubscriptionAcquire( sh, subKey, &iter, &lserror )
+         && LSSubscriptionHasNext( iter ) ) {
+        gchar* value = NULL;
+        gchar* text;
+        LPErr err = LPAppCopyValue( handle, key, &value );
+        if ( LP_ERR_NONE == err ) {
+            text = keyValueReplyText( key, value, NULL );
+        } else {
+            char* errMsg = NULL;
+            (void)LPErrorString( err, &errMsg );
+            text = g_strdup_printf( "{\"returnValue\": false, \"errorText\": \"%s\"}",
+                                    errMsg );
+            g_free( errMsg );
+        }
+        if ( !LSSubscriptionReply( sh, subKey, text, &lserror ) ) {
+            LSErrorPrint( &lserror, stderr );
+        }
+        g_free( text );
+        g_free( value );
+    }
+    if ( NULL != iter ) {
+        LSSubscriptionRelease( iter );
+    }
+    FREE_IF_SET( &lserror );
+    g_free( subKey );
+}
 
-com.palm.preferences/appProperties/getAppKeysObj
+/* Tell getAllAppProperties subscribers to appId whose prefix matches any of
+ * keys about the values now.  Each may have its own prefix, so each is sent
+ * its own reply. */
+static void
+notify_all( LSHandle* sh, LPAppHandle handle, const char* appId, GPtrArray* keys )
+{
+    gchar* subKey = subscription_key( "getAllAppProperties", appId, NULL );
+    LSSubscriptionIter* iter = NULL;
+    LSError lserror;
+    LSErrorInit( &lserror );
 
-Get all property keys for an application as a JSON object.
+    if ( LSSubscriptionAcquire( sh, subKey, &iter, &lserror ) ) {
+        while ( LSSubscriptionHasNext( iter ) ) {
+            LSMessage* message = LSSubscriptionNext( iter );
+            struct json_object* payload = json_tokener_parse( LSMessageGetPayload( message ) );
+            const char* prefix = NULL;
+            bool matches = false;
+            guint ii;
+
+            if ( !is_error(payload) ) {
+                struct json_object* param = json_object_object_get( payload, "prefix" );
+                if ( !!param && json_object_is_type( param, json_type_string ) ) {
+                    prefix = json_object_get_string( param );
+                }
+            }
+            for ( ii = 0; !matches && ii < keys->len; ++ii ) {
+                matches = NULL == prefix
+                    || g_str_has_prefix( g_ptr_array_index( keys, ii ), prefix );
+            }
 
-\subsection com_palm_preferences_app_properties_get_app_keys_obj_syntax Syntax:
-\code
-{
-    "appId": string
+            struct json_object* json = NULL;
+            if ( matches
+                 && LP_ERR_NONE == LPAppCopyAllWithPrefixCJ( handle, prefix, &json ) ) {
+                if ( !LSMessageReply( sh, message, json_object_to_json_string( json ),
+                                      &lserror ) ) {
+                    LSErrorPrint( &lserror, stderr );
+                    FREE_IF_SET( &lserror );
+                }
+                json_object_put( json );
+            }
+            if ( !is_error(payload) ) {
+                json_object_put( payload );
+            }
+        }
+        LSSubscriptionRelease( iter );
+    }
+    FREE_IF_SET( &lserror );
+    g_free( subKey );
 }
-\endcode
-
-\param appId Id for the application.
 
-\subsection com_palm_preferences_app_properties_get_app_keys_obj_returns Returns:
-\code
+/* Tell appId's subscribers about committed changes to keys */
+static void
+notify_changes( LSHandle* sh, const char* appId, GPtrArray* keys )
 {
-    "values": [ string array ],
-    "returnValue": boolean,
-    "errorText": string
+    LPAppHandle handle;
+    if ( 0 < keys->len && LP_ERR_NONE == pool_get_handle( appId, &handle ) ) {
+        guint ii;
+        for ( ii = 0; ii < keys->len; ++ii ) {
+            notify_key( sh, handle, appId, g_ptr_array_index( keys, ii ) );
+        }
+        notify_all( sh, handle, appId, keys );
+        (void)pool_release_handle( appId, handle, false );
+    }
 }
-\endcode
 
-\param values Property keys as a string array.
-\param returnValue Indicates if the call was succesful.
-\param errorText Describes the error if call was not succesful.
+/*
+ * The write-behind queue.  Each set or remove is queued for its app and the
+ * caller's reply held back; sWriteWindowMs after the first one arrives the
+ * app's queue is applied in order and committed as one transaction, and
+ * only then does everyone get their reply.  A burst of writes from one app
+ * thus pays for one commit rather than one each.  Each write succeeds or
+ * fails by itself, as it would have alone, except that a failed commit
+ * fails all of them.  Anything that gets an app's handle from the pool
+ * flushes its queue first, so reads always see queued writes.
+ */
+typedef enum {
+    WRITE_SET,
+    WRITE_SET_MANY,
+    WRITE_PATCH,
+    WRITE_REMOVE
+} WriteKind;
+
+typedef struct PendingWrite {
+    WriteKind   kind;
+    LSHandle*   sh;
+    LSMessage*  message;        /* ref'd until replied to */
+    gchar*      key;            /* WRITE_SET, WRITE_PATCH, WRITE_REMOVE */
+    gchar*      value;          /* WRITE_SET; the patch for WRITE_PATCH */
+    GPtrArray*  keys;           /* WRITE_SET_MANY */
+    GPtrArray*  values;
+} PendingWrite;
+
+typedef struct WriteBatch {
+    gchar*      appId;
+    GQueue      writes;         /* of PendingWrite*, oldest first */
+    GSource*    timer;
+} WriteBatch;
+
+static GHashTable* sWriteBatches = NULL; /* appId -> WriteBatch* */
+static guint sWriteWindowMs = APP_WRITE_WINDOW_MS;
+
+static PendingWrite*
+write_new( WriteKind kind, LSHandle* sh, LSMessage* message )
+{
+    PendingWrite* write = g_new0( PendingWrite, 1 );
+    write->kind = kind;
+    write->sh = sh;
+    write->message = message;
+    LSMessageRef( message );
+    return write;
+}
 
-\subsection com_palm_preferences_app_properties_get_app_keys_obj_examples Examples:
-\code
-luna-send -n 1 -f luna://com.palm.preferences/appProperties/getAppKeysObj '{"appId": "com.palm.app.calendar"}'
-\endcode
+static void
+write_free( PendingWrite* write )
+{
+    LSMessageUnref( write->message );
+    g_free( write->key );
+    g_free( write->value );
+    if ( NULL != write->keys ) {
+        g_ptr_array_free( write->keys, TRUE );
+        g_ptr_array_free( write->values, TRUE );
+    }
+    g_free( write );
+}
+
+static LPErr
+write_apply( LPAppHandle handle, PendingWrite* write )
+{
+    LPErr err = LP_ERR_INTERNAL;
+    switch ( write->kind ) {
+    case WRITE_SET:
+        err = LPAppSetValue( handle, write->key, write->value );
+        break;
+    case WRITE_SET_MANY:
+        err = LPAppSetValues( handle, (const char* const*)write->keys->pdata,
+                              (const char* const*)write->values->pdata,
+                              write->keys->len );
+        break;
+    case WRITE_PATCH:
+        err = LPAppPatchValue( handle, write->key, write->value );
+        break;
+    case WRITE_REMOVE:
+        err = LPAppRemoveValue( handle, write->key );
+        break;
+    }
+    return err;
+}
 
-Example response for a succesful call:
+/* Add the keys write changes to keys, g_strdup'd */
+static void
+write_changed_keys( PendingWrite* write, GPtrArray* keys )
+{
+    guint ii;
+    if ( WRITE_SET_MANY == write->kind ) {
+        for ( ii = 0; ii < write->keys->len; ++ii ) {
+            g_ptr_array_add( keys, g_strdup( g_ptr_array_index( write->keys, ii ) ) );
+        }
+    } else {
+        g_ptr_array_add( keys, g_strdup( write->key ) );
+    }
+}
+
+/* Apply and commit the batch, reply to everyone in it, tell subscribers,
+ * and free it */
+static void
+write_flush( WriteBatch* batch )
+{
+    g_hash_table_remove( sWriteBatches, batch->appId );
+    if ( NULL != batch->timer ) {
+        g_source_destroy( batch->timer );
+        g_source_unref( batch->timer );
+    }
+
+    guint count = g_queue_get_length( &batch->writes );
+    LPErr* errs = g_new( LPErr, count );
+    LPAppHandle handle;
+    LPErr err = pool_get_handle( batch->appId, &handle );
+    bool anyApplied = false;
+    GList* node;
+    guint ii;
+
+    for ( ii = 0, node = batch->writes.head; NULL != node; ++ii, node = node->next ) {
+        errs[ii] = LP_ERR_NONE == err ? write_apply( handle, node->data ) : err;
+        anyApplied = anyApplied || LP_ERR_NONE == errs[ii];
+    }
+    if ( LP_ERR_NONE == err ) {
+        err = pool_release_handle( batch->appId, handle, anyApplied );
+    }
+    g_debug( "%s: %d write(s) to %s=>%d", __func__, count, batch->appId, err );
+
+    GPtrArray* changed = g_ptr_array_new_with_free_func( g_free );
+    LSHandle* sh = NULL;
+    PendingWrite* write;
+    for ( ii = 0; NULL != (write = g_queue_pop_head( &batch->writes )); ++ii ) {
+        if ( LP_ERR_NONE == errs[ii] ) {
+            errs[ii] = err;     /* the commit */
+        }
+        if ( LP_ERR_NONE == errs[ii] ) {
+            successReply( write->sh, write->message );
+            write_changed_keys( write, changed );
+            sh = write->sh;
+        } else {
+            errorReplyErr( write->sh, write->message, errs[ii] );
+        }
+        write_free( write );
+    }
+
+    if ( NULL != sh ) {
+        maintain_mark( batch->appId );
+        notify_changes( sh, batch->appId, changed );
+    }
+    g_ptr_array_free( changed, TRUE );
+
+    g_free( errs );
+    g_free( batch->appId );
+    g_free( batch );
+} /* write_flush */
+
+static gboolean
+writeTimerFunc( gpointer data )
+{
+    WriteBatch* batch = (WriteBatch*)data;
+    g_source_unref( batch->timer );
+    batch->timer = NULL;        /* it's going away once we return */
+    write_flush( batch );
+    return false;
+}
+
+/* Queue a write for appId, which takes over the write and its reply */
+static void
+write_submit( const char* appId, PendingWrite* write )
+{
+    if ( NULL == sWriteBatches ) {
+        sWriteBatches = g_hash_table_new( g_str_hash, g_str_equal );
+    }
+
+    WriteBatch* batch = g_hash_table_lookup( sWriteBatches, appId );
+    if ( NULL == batch ) {
+        batch = g_new0( WriteBatch, 1 );
+        batch->appId = g_strdup( appId );
+        g_queue_init( &batch->writes );
+        g_hash_table_insert( sWriteBatches, batch->appId, batch );
+    }
+    g_queue_push_tail( &batch->writes, write );
+
+    if ( 0 == sWriteWindowMs
+         || g_queue_get_length( &batch->writes ) >= APP_WRITE_BATCH_MAX ) {
+        write_flush( batch );
+    } else if ( NULL == batch->timer ) {
+        batch->timer = g_timeout_source_new( sWriteWindowMs );
+        g_source_set_callback( batch->timer, writeTimerFunc, batch, NULL );
+        (void)g_source_attach( batch->timer, NULL );
+    }
+}
+
+static void
+write_flush_app( const char* appId )
+{
+    WriteBatch* batch = NULL == sWriteBatches ? NULL
+        : g_hash_table_lookup( sWriteBatches, appId );
+    if ( NULL != batch ) {
+        write_flush( batch );
+    }
+}
+
+static void
+write_flush_all( void )
+{
+    GList* batches = NULL == sWriteBatches ? NULL
+        : g_hash_table_get_values( sWriteBatches );
+    GList* node;
+    for ( node = batches; NULL != node; node = node->next ) {
+        write_flush( node->data );
+    }
+    g_list_free( batches );
+}
+
+static bool
+getStringParam( struct json_object* param, char** str )
+{
+    bool ok = !!param
+        && json_object_is_type( param, json_type_string );
+    if ( ok ) {
+        *str = g_strdup( json_object_get_string( param ) );
+    }
+    return ok;
+}
+
+typedef LPErr (*AppGetter)( LPAppHandle handle, const char* prefix,
+                            struct json_object** json );
+
+/* subMethod names the subscriptions the call may make, if it can make any */
+static bool
+appGet_internal( LSHandle* sh, LSMessage* message, AppGetter getter, bool asObj,
+                 const char* subMethod )
+{
+    LPErr err = LP_ERR_NONE;
+    gchar* appId = NULL;
+    gchar* prefix = NULL;
+    struct json_object* json = NULL;
+    LPAppHandle handle = NULL;
+
+    struct json_object* payload = json_tokener_parse( LSMessageGetPayload( message ) );
+    if ( !is_error(payload)
+         && getStringParam( json_object_object_get( payload, "appId" ), &appId ) ) {
+        /* optional: only keys beginning with this */
+        struct json_object* prefixParam = json_object_object_get( payload, "prefix" );
+        if ( !!prefixParam && !getStringParam( prefixParam, &prefix ) ) {
+            err = LP_ERR_PARAM_ERR;
+            goto error;
+        }
+
+        err = pool_get_handle( appId, &handle );
+        if ( 0 != err ) goto error;
+
+        err = (*getter)( handle, prefix, &json );
+        if ( 0 != err ) goto error;
+
+        if ( asObj ) {
+            json = wrapArray( json );
+        }
+
+        LSError lserror;
+        LSErrorInit( &lserror );
+
+        if ( !LSMessageReply( sh, message,
+                              json_object_to_json_string(json),
+                              &lserror ) ) {
+            LSErrorPrint( &lserror, stderr );
+        } else if ( NULL != subMethod ) {
+            subscription_add( sh, message, subMethod, appId, NULL );
+        }
+        FREE_IF_SET (&lserror);
+    } else {
+        errorReplyStr( sh, message, "no appId parameter found" );
+    }
+
+ error:
+    errorReplyErr( sh, message, err );
+    if ( !!handle ) {
+        (void)pool_release_handle( appId, handle, FALSE );
+    }
+    g_free( appId );
+    g_free( prefix );
+    json_object_put( json );
+    if ( !is_error(payload) ) {
+        json_object_put( payload );
+    }
+
+    return true;
+} /* appGetKeys */
+
+/*!
+\page com_palm_preferences_app_properties
+\n
+\section com_palm_preferences_app_properties_get_app_keys getAppKeys
+
+\e Public.
+
+com.palm.preferences/appProperties/getAppKeys
+
+Get all property keys for an application as a string array.
+
+\subsection com_palm_preferences_app_properties_get_app_keys_syntax Syntax:
+\code
+{
+    "appId": string,
+    "prefix": string
+}
+\endcode
+
+\param appId Id for the application.
+\param prefix Optional.  Only properties whose keys begin with this are returned.
+
+\subsection com_palm_preferences_app_properties_get_app_keys_returns_succesful Returns with a succesful call:
+\code
+[ string array ]
+\endcode
+
+\subsection com_palm_preferences_app_properties_get_app_keys_returns_failure Returns with a failed call:
+\code
+{
+    "returnValue": boolean,
+    "errorText": string
+}
+\endcode
+
+\param returnValue Indicates if the call was succesful, i.e. always false in this situation.
+\param errorText Describes the error.
+
+\subsection com_palm_preferences_app_properties_get_app_keys_examples Examples:
+\code
+luna-send -n 1 -f luna://com.palm.preferences/appProperties/getAppKeys '{"appId": "com.palm.app.calendar"}'
+\endcode
+
+Example response for a succesful call:
+\code
+[
+    "aKey",
+    "anotherKey"
+]
+\endcode
+
+Example response for a failed call:
+\code
+{
+    "returnValue": false,
+    "errorText": "no appId parameter found"
+}
+\endcode
+*/
+static bool
+appGetKeys( LSHandle* sh, LSMessage* message, void* user_data )
+{
+    reset_timer();
+    g_debug( "%s(%s)", __func__, LSMessageGetPayload(message) );
+    return appGet_internal( sh, message, LPAppCopyKeysWithPrefixCJ, false, NULL );
+}
+
+/*!
+\page com_palm_preferences_app_properties
+\n
+\section com_palm_preferences_app_properties_get_app_keys_obj getAppKeysObj
+
+\e Public.
+
+com.palm.preferences/appProperties/getAppKeysObj
+
+Get all property keys for an application as a JSON object.
+
+\subsection com_palm_preferences_app_properties_get_app_keys_obj_syntax Syntax:
+\code
+{
+    "appId": string,
+    "prefix": string
+}
+\endcode
+
+\param appId Id for the application.
+\param prefix Optional.  Only properties whose keys begin with this are returned.
+
+\subsection com_palm_preferences_app_properties_get_app_keys_obj_returns Returns:
+\code
+{
+    "values": [ string array ],
+    "returnValue": boolean,
+    "errorText": string
+}
+\endcode
+
+\param values Property keys as a string array.
+\param returnValue Indicates if the call was succesful.
+\param errorText Describes the error if call was not succesful.
+
+\subsection com_palm_preferences_app_properties_get_app_keys_obj_examples Examples:
+\code
+luna-send -n 1 -f luna://com.palm.preferences/appProperties/getAppKeysObj '{"appId": "com.palm.app.calendar"}'
+\endcode
+
+Example response for a succesful call:
 \code
 {
     "values": [
@@ -1186,7 +1892,7 @@ appGetKeysObj( LSHandle* sh, LSMessage* message, void* user_data )
 {
     reset_timer();
     g_debug( "%s(%s)", __func__, LSMessageGetPayload(message) );
-    return appGet_internal( sh, message, LPAppCopyKeysCJ, true );
+    return appGet_internal( sh, message, LPAppCopyKeysWithPrefixCJ, true, NULL );
 }
 
 /*!
@@ -1203,11 +1909,16 @@ Get all properties set to an application as an object array.
 \subsection com_palm_preferences_app_properties_get_all_app_properties_syntax Syntax:
 \code
 {
-    "appId": string
+    "appId": string,
+    "prefix": string,
+    "subscribe": boolean
 }
 \endcode
 
 \param appId Id for the application.
+\param prefix Optional.  Only properties whose keys begin with this are returned.
+\param subscribe Optional.  If true, the same reply is sent again whenever
+properties whose keys begin with prefix are changed.
 
 \subsection com_palm_preferences_app_properties_get_all_app_properties_returns_succesful Returns with a succesful call:
 \code
@@ -1277,77 +1988,763 @@ appGetAll( LSHandle* sh, LSMessage* message, void* user_data )
 {
     g_debug( "%s(%s)", __func__, LSMessageGetPayload(message) );
     reset_timer();
-    return appGet_internal( sh, message, LPAppCopyAllCJ, false );
+    return appGet_internal( sh, message, LPAppCopyAllWithPrefixCJ, false,
+                            "getAllAppProperties" );
 } /* appGetAll */
 
 /*!
 \page com_palm_preferences_app_properties
 \n
-\section com_palm_preferences_app_properties_get_all_app_properties_obj getAllAppPropertiesObj
+\section com_palm_preferences_app_properties_get_all_app_properties_obj getAllAppPropertiesObj
+
+\e Public.
+
+com.palm.preferences/appProperties/getAllAppPropertiesObj
+
+Get all properties set to an application as an object.
+
+\subsection com_palm_preferences_app_properties_get_all_app_properties_obj_syntax Syntax:
+\code
+{
+    "appId": string,
+    "prefix": string
+}
+\endcode
+
+\param appId Id for the application.
+\param prefix Optional.  Only properties whose keys begin with this are returned.
+
+\subsection com_palm_preferences_app_properties_get_all_app_properties_obj_returns Returns:
+\code
+{
+    "values": [
+        {
+            "<key>": object
+        },
+        {
+            "<key>": object
+        },
+        ...
+    ],
+    "returnValue": boolean,
+    "errorText": string
+]
+\endcode
+
+\param values Object array containing the keys and their property objects.
+\param <key> Object containing the property for this key.
+\param returnValue Indicates if the call was succesful.
+\param errorText Describes the error.
+
+\subsection com_palm_preferences_app_properties_get_all_app_properties_obj_examples Examples:
+\code
+luna-send -n 1 -f luna://com.palm.preferences/appProperties/getAllAppPropertiesObj '{"appId": "com.palm.app.calendar"}'
+\endcode
+
+Example response for a succesful call:
+\code
+{
+    "values": [
+        {
+            "aKey": {
+                "aValue": "lots"
+            }
+        },
+        {
+            "anotherKey": {
+                "anotherValue": "many"
+            }
+        },
+        {
+            "oneMoreKey": {
+                "anInt": 1,
+                "anotherInt": 2
+            }
+        }
+    ],
+    "returnValue": true
+}
+\endcode
+
+Example response for a failed call:
+\code
+{
+    "returnValue": false,
+    "errorText": "no appId parameter found"
+}
+
+\endcode
+*/
+static bool
+appGetAllObj( LSHandle* sh, LSMessage* message, void* user_data )
+{
+    g_debug( "%s(%s)", __func__, LSMessageGetPayload(message) );
+    reset_timer();
+    return appGet_internal( sh, message, LPAppCopyAllWithPrefixCJ, true, NULL );
+} /* appGetAllObj */
+
+/*!
+\page com_palm_preferences_app_properties
+\n
+\section com_palm_preferences_app_properties_get_app_changes getAppChanges
+
+\e Public.
+
+com.palm.preferences/appProperties/getAppChanges
+
+Get what has changed in an application's properties since an earlier call,
+for backing them up or syncing them without fetching them all.  Every change
+and every removal is numbered, and each reply carries the latest number,
+to be passed back next time.
+
+\subsection com_palm_preferences_app_properties_get_app_changes_syntax Syntax:
+\code
+{
+    "appId": string,
+    "seq": int
+}
+\endcode
+
+\param appId Id for the application.
+\param seq Optional.  The "seq" from the last reply; 0, the default, gets
+everything.  If the application's data was cleared since, or lost so
+that seq is larger than any number given out, everything is returned and
+"reset" is true.
+
+\subsection com_palm_preferences_app_properties_get_app_changes_returns Returns:
+\code
+{
+    "seq": int,
+    "reset": boolean,
+    "changed": [
+        { "key": string, "value": object, "seq": int },
+        ...
+    ],
+    "removed": [
+        { "key": string, "seq": int },
+        ...
+    ],
+    "returnValue": boolean,
+    "errorText": string
+}
+\endcode
+
+\param seq The latest change's number.
+\param reset Present, and true, if what was got before must be thrown away.
+\param changed The properties set since, with their values now.
+\param removed The properties removed since.
+\param returnValue Indicates if the call was succesful.
+\param errorText Describes the error.
+
+\subsection com_palm_preferences_app_properties_get_app_changes_examples Examples:
+\code
+luna-send -n 1 -f luna://com.palm.preferences/appProperties/getAppChanges '{"appId": "com.palm.app.calendar", "seq": 41}'
+\endcode
+
+Example response for a succesful call:
+\code
+{
+    "seq": 43,
+    "changed": [
+        { "key": "oneMoreKey", "value": {"anInt": 1, "anotherInt": 2}, "seq": 43 }
+    ],
+    "removed": [
+        { "key": "aKey", "seq": 42 }
+    ],
+    "returnValue": true
+}
+\endcode
+*/
+static bool
+appGetChanges( LSHandle* sh, LSMessage* message, void* user_data )
+{
+    g_debug( "%s(%s)", __func__, LSMessageGetPayload(message) );
+    reset_timer();
+
+    LPErr err = LP_ERR_NONE;
+    gchar* appId = NULL;
+    struct json_object* json = NULL;
+
+    struct json_object* payload = json_tokener_parse( LSMessageGetPayload( message ) );
+    if ( !is_error(payload)
+         && getStringParam( json_object_object_get( payload, "appId" ), &appId ) ) {
+        long long seq = 0;
+        struct json_object* seqParam = json_object_object_get( payload, "seq" );
+        if ( !!seqParam ) {
+            if ( json_object_is_type( seqParam, json_type_int ) ) {
+                seq = json_object_get_int64( seqParam );
+            } else {
+                err = LP_ERR_PARAM_ERR;
+            }
+        }
+
+        LPAppHandle handle;
+        if ( LP_ERR_NONE == err ) {
+            err = pool_get_handle( appId, &handle );
+        }
+        if ( LP_ERR_NONE == err ) {
+            err = LPAppCopyChangesSinceCJ( handle, seq, &json );
+            (void)pool_release_handle( appId, handle, false );
+        }
+
+        if ( LP_ERR_NONE == err ) {
+            add_true_result( json );
+
+            LSError lserror;
+            LSErrorInit( &lserror );
+            if ( !LSMessageReply( sh, message, json_object_to_json_string( json ),
+                                  &lserror ) ) {
+                LSErrorPrint( &lserror, stderr );
+            }
+            FREE_IF_SET( &lserror );
+            json_object_put( json );
+        } else {
+            errorReplyErr( sh, message, err );
+        }
+    } else {
+        errorReplyStrMissingParam( sh, message, "appId" );
+    }
+
+    g_free( appId );
+    if ( !is_error(payload) ) {
+        json_object_put( payload );
+    }
+    return true;
+} /* appGetChanges */
+
+/*!
+\page com_palm_preferences_app_properties
+\n
+\section com_palm_preferences_app_properties_get_app_property getAppProperty
+
+\e Public.
+
+com.palm.preferences/appProperties/getAppProperty
+
+Get an application property for a specific key.
+
+\subsection com_palm_preferences_app_properties_get_app_property_syntax Syntax:
+\code
+{
+    "appId": string,
+    "key": string,
+    "returnVersion": boolean,
+    "subscribe": boolean
+}
+\endcode
+
+\param appId Id for the application.
+\param key Key for the property.
+\param returnVersion Optional; if true, the reply carries the property's
+version, for passing to casAppProperty.
+\param subscribe Optional.  If true, a reply is sent again whenever the
+property is changed or removed.  Those replies don't carry the version.
+
+\subsection com_palm_preferences_app_properties_get_app_property_returns Returns:
+\code
+{
+    "<key>": object,
+    "version": int,
+    "returnValue": boolean,
+    "errorText": string
+}
+\endcode
+
+\param <key> Object containing the property for this key.
+\param version The property's version, if returnVersion was given.
+\param returnValue Indicates if the call was succesful.
+\param errorText Describes the error.
+
+\subsection com_palm_preferences_app_properties_get_app_property_examples Examples:
+\code
+luna-send -n 1 -f luna://com.palm.preferences/appProperties/getAppProperty '{"appId": "com.palm.app.calendar", "key": "oneMoreKey"}'
+\endcode
+
+Example response for a succesful call:
+\code
+{
+    "oneMoreKey": {
+        "anInt": 1,
+        "anotherInt": 2
+    },
+    "returnValue": true
+}
+\endcode
+
+Example response for a failed call:
+\code
+{
+    "returnValue": false,
+    "errorText": "no such key"
+}
+\endcode
+*/
+static bool
+appGetValue( LSHandle* sh, LSMessage* message, void* user_data )
+{
+    g_debug( "%s(%s)", __func__, LSMessageGetPayload(message) );
+    reset_timer();
+
+    LPErr err = -1;           /* not 0 */
+
+    gchar* appId = NULL;
+    gchar* key = NULL;
+    if ( parseMessage( message,
+                       "appId", json_type_string, &appId,
+                       "key", json_type_string, &key,
+                       NULL ) ) {
+        LPAppHandle handle;
+        gchar* value = NULL;
+        long long version;
+        bool returnVersion = false;
+
+        struct json_object* payload = json_tokener_parse( LSMessageGetPayload( message ) );
+        if ( !is_error(payload) ) {
+            struct json_object* param = json_object_object_get( payload, "returnVersion" );
+            returnVersion = !!param && json_object_is_type( param, json_type_boolean )
+                && json_object_get_boolean( param );
+            json_object_put( payload );
+        }
+
+        LSError lserror;
+        LSErrorInit(&lserror);
+
+        err = pool_get_handle( appId, &handle );
+        if ( 0 != err ) goto error;
+        err = LPAppCopyValueVersioned( handle, key, &value, &version );
+        if ( 0 != err ) goto err_with_handle;
+        if ( !replyWithKeyValue( sh, message, &lserror, key, value,
+                                 returnVersion ? &version : NULL ) ) goto err_with_handle;
+        err = 0;
+        subscription_add( sh, message, "getAppProperty", appId, key );
+        LSErrorPrint(&lserror, stderr);
+        FREE_IF_SET (&lserror);
+    err_with_handle:
+        errorReplyErr( sh, message, err );
+        err = pool_release_handle( appId, handle, true );
+        if ( 0 != err ) goto error;
+    error:
+        g_free( appId );
+        g_free( key );
+        g_free( value );
+    } else {
+        errorReplyStr( sh, message, "no appId or key parameter found" );
+    }
+
+    return true;
+} /* appGetValue */
+
+/*!
+\page com_palm_preferences_app_properties
+\n
+\section com_palm_preferences_app_properties_get_some_app_properties getSomeAppProperties
+
+\e Public.
+
+com.palm.preferences/appProperties/getSomeAppProperties
+
+Get the application properties for a list of keys.  Returns an array of
+objects equivalent to what getAppProperty would have returned for each key.
+
+If one of them fails an error is returned in that element of the array but the
+rest go through.
+
+\subsection com_palm_preferences_app_properties_get_some_app_properties_syntax Syntax:
+\code
+{
+    "appId": string,
+    "keys": [ string array ]
+}
+\endcode
+
+\param appId Id for the application.
+\param keys Keys of the properties to get.
+
+\subsection com_palm_preferences_app_properties_get_some_app_properties_returns Returns:
+\code
+{
+    "values": [
+        {
+            "<key>": object
+        },
+        {
+            "errorText": string
+        }
+    ],
+    "returnValue": boolean,
+    "errorText": string
+}
+\endcode
+
+\param values One object per key asked for, in the same order.
+\param returnValue Indicates if the call was succesful.
+\param errorText Describes the error.
+
+\subsection com_palm_preferences_app_properties_get_some_app_properties_examples Examples:
+\code
+luna-send -n 1 -f luna://com.palm.preferences/appProperties/getSomeAppProperties '{"appId": "com.palm.app.calendar", "keys": ["aKey", "noSuchKey"]}'
+\endcode
+
+Example response for a succesful call:
+\code
+{
+    "values": [
+        {
+            "aKey": {
+                "aValue": "lots"
+            }
+        },
+        {
+            "errorText": "no such key"
+        }
+    ],
+    "returnValue": true
+}
+\endcode
+
+Example response for a failed call:
+\code
+{
+    "returnValue": false,
+    "errorText": "Missing required parameter \"keys\"."
+}
+\endcode
+*/
+static bool
+appGetSome( LSHandle* sh, LSMessage* message, void* user_data )
+{
+    g_debug( "%s(%s)", __func__, LSMessageGetPayload(message) );
+    reset_timer();
+
+    struct json_object* payload = json_tokener_parse( LSMessageGetPayload( message ) );
+    if ( is_error(payload) ) {
+        errorReplyErr( sh, message, LP_ERR_PARAM_ERR );
+        return true;
+    }
+
+    struct json_object* appId = json_object_object_get( payload, "appId" );
+    struct json_object* keys = json_object_object_get( payload, "keys" );
+
+    if ( !appId || !json_object_is_type( appId, json_type_string ) ) {
+        errorReplyStrMissingParam( sh, message, "appId" );
+    } else if ( !keys || !json_object_is_type( keys, json_type_array ) ) {
+        errorReplyStrMissingParam( sh, message, "keys" );
+    } else {
+        const char* appIdString = json_object_get_string( appId );
+        int len = json_object_array_length( keys );
+        const char** keyStrings = g_new0( const char*, len );
+        char** values = g_new0( char*, len );
+        LPErr* errs = g_new0( LPErr, len );
+        int ii;
+
+        for ( ii = 0; ii < len; ++ii ) {
+            struct json_object* key = json_object_array_get_idx( keys, ii );
+            if ( json_object_is_type( key, json_type_string ) ) {
+                keyStrings[ii] = json_object_get_string( key );
+            }
+        }
+
+        LPAppHandle handle;
+        LPErr err = pool_get_handle( appIdString, &handle );
+        if ( LP_ERR_NONE == err ) {
+            err = LPAppCopyValues( handle, keyStrings, values, errs, len );
+            (void)pool_release_handle( appIdString, handle, false );
+        }
+
+        if ( LP_ERR_NONE == err ) {
+            struct json_object* arrayOut = json_object_new_array();
+            for ( ii = 0; ii < len; ++ii ) {
+                struct json_object* elemOut = json_object_new_object();
+                if ( NULL != values[ii] ) {
+                    json_object_object_add( elemOut, keyStrings[ii],
+                                            json_tokener_parse( values[ii] ) );
+                } else {
+                    char* errMsg = NULL;
+                    (void)LPErrorString( errs[ii], &errMsg );
+                    json_object_object_add( elemOut, "errorText",
+                                            json_object_new_string( errMsg ) );
+                    g_free( errMsg );
+                }
+                (void)json_object_array_add( arrayOut, elemOut );
+            }
+
+            struct json_object* result = wrapArray( arrayOut );
+            LSError lserror;
+            LSErrorInit( &lserror );
+            (void)replyWithValue( sh, message, &lserror,
+                                  json_object_to_json_string( result ) );
+            FREE_IF_SET( &lserror );
+            json_object_put( result );
+        } else {
+            errorReplyErr( sh, message, err );
+        }
+
+        for ( ii = 0; ii < len; ++ii ) {
+            g_free( values[ii] );
+        }
+        g_free( keyStrings );
+        g_free( values );
+        g_free( errs );
+    }
+
+    json_object_put( payload );
+    return true;
+} /* appGetSome */
+
+/*!
+\page com_palm_preferences_app_properties
+\n
+\section com_palm_preferences_app_properties_set_app_property setAppProperty
+
+\e Public.
+
+com.palm.preferences/appProperties/setAppProperty
+
+Add or change an application property.
+
+\subsection com_palm_preferences_app_properties_set_app_property_syntax Syntax:
+\code
+{
+    "appId": string,
+    "key": string,
+    "value": object
+}
+\endcode
+
+\param appId Id for the application.
+\param key Key for the property.
+\param value Value for the property.
+
+\subsection com_palm_preferences_app_properties_set_app_property_returns Returns:
+\code
+{
+    "returnValue": boolean,
+    "errorText": string
+}
+\endcode
+
+\param returnValue Indicates if the call was succesful.
+\param errorText Describes the error.
+
+\subsection com_palm_preferences_app_properties_set_app_property_examples Examples:
+\code
+luna-send -n 1 -f luna://com.palm.preferences/appProperties/setAppProperty '{"appId": "com.palm.app.calendar", "key": "oneMoreKey", "value": {"anInt": 1, "anotherInt": 3} }'
+\endcode
+
+Example response for a succesful call:
+\code
+{
+    "returnValue": true
+}
+\endcode
+
+Example response for a failed call:
+\code
+{
+    "returnValue": false,
+    "errorText": "illegal value (not a json document)"
+}
+\endcode
+*/
+static bool
+appSetValue( LSHandle* sh, LSMessage* message, void* user_data )
+{
+    reset_timer();
+
+    g_debug( "%s(%s)", __func__, LSMessageGetPayload(message) );
+
+    struct json_object* payload = json_tokener_parse( LSMessageGetPayload( message ) );
+    if ( !is_error(payload) ) {
+        struct json_object* appId = json_object_object_get( payload, "appId" );
+        struct json_object* key = json_object_object_get( payload, "key");
+        struct json_object* value = json_object_object_get( payload, "value");
+        gchar* appIdString = NULL;
+        gchar* keyString = NULL;
+
+        if ( !getStringParam( appId, &appIdString ) ) {
+            errorReplyStrMissingParam( sh, message, "appId" );
+        } else if ( g_strcmp0(g_strstrip(appIdString),"") == 0) {
+            errorReplyStrMissingParam( sh, message, "appId" );
+        } else if ( !getStringParam( key, &keyString ) ) {
+            errorReplyStrMissingParam( sh, message, "key" );
+        } else if ( !value ) {
+            errorReplyStrMissingParam( sh, message, "value" );
+        } else {
+            gchar* valString = json_object_get_string( value );
+            if ( !!valString ) {
+                PendingWrite* write = write_new( WRITE_SET, sh, message );
+                write->key = keyString;
+                keyString = NULL;
+                write->value = g_strdup( valString );
+                write_submit( appIdString, write ); /* it replies */
+            } else {
+                errorReplyErr( sh, message, LP_ERR_VALUENOTJSON );
+            }
+        }
+
+        g_free( keyString );
+        g_free( appIdString );
+        json_object_put( payload );
+    }
+
+    return true;
+} /* appSetValue */
+
+/*!
+\page com_palm_preferences_app_properties
+\n
+\section com_palm_preferences_app_properties_set_app_properties setAppProperties
+
+\e Public.
+
+com.palm.preferences/appProperties/setAppProperties
+
+Add or change several application properties at once.  Either all of them
+are stored or, if any one is refused, none are.
+
+\subsection com_palm_preferences_app_properties_set_app_properties_syntax Syntax:
+\code
+{
+    "appId": string,
+    "values": {
+        "<key>": object,
+        "<key>": object,
+        ...
+    }
+}
+\endcode
+
+\param appId Id for the application.
+\param values Object mapping each key to its new value.
+
+\subsection com_palm_preferences_app_properties_set_app_properties_returns Returns:
+\code
+{
+    "returnValue": boolean,
+    "errorText": string
+}
+\endcode
+
+\param returnValue Indicates if the call was succesful.
+\param errorText Describes the error.
+
+\subsection com_palm_preferences_app_properties_set_app_properties_examples Examples:
+\code
+luna-send -n 1 -f luna://com.palm.preferences/appProperties/setAppProperties '{"appId": "com.palm.app.calendar", "values": {"aKey": {"aValue": "lots"}, "oneMoreKey": {"anInt": 1, "anotherInt": 3}} }'
+\endcode
+
+Example response for a succesful call:
+\code
+{
+    "returnValue": true
+}
+\endcode
+
+Example response for a failed call:
+\code
+{
+    "returnValue": false,
+    "errorText": "illegal value (not a json document)"
+}
+\endcode
+*/
+static bool
+appSetValues( LSHandle* sh, LSMessage* message, void* user_data )
+{
+    reset_timer();
+
+    g_debug( "%s(%s)", __func__, LSMessageGetPayload(message) );
+    LPErr err;
+
+    struct json_object* payload = json_tokener_parse( LSMessageGetPayload( message ) );
+    if ( !is_error(payload) ) {
+        struct json_object* appId = json_object_object_get( payload, "appId" );
+        struct json_object* values = json_object_object_get( payload, "values" );
+        gchar* appIdString = NULL;
+
+        if ( !getStringParam( appId, &appIdString ) ) {
+            errorReplyStrMissingParam( sh, message, "appId" );
+        } else if ( g_strcmp0(g_strstrip(appIdString),"") == 0) {
+            errorReplyStrMissingParam( sh, message, "appId" );
+        } else if ( !values || !json_object_is_type( values, json_type_object ) ) {
+            errorReplyStrMissingParam( sh, message, "values" );
+        } else {
+            PendingWrite* write = write_new( WRITE_SET_MANY, sh, message );
+            write->keys = g_ptr_array_new_with_free_func( g_free );
+            write->values = g_ptr_array_new_with_free_func( g_free );
+            err = LP_ERR_NONE;
+
+            json_object_object_foreach( values, key, value ) {
+                const char* valString = json_object_get_string( value );
+                if ( !valString ) {
+                    err = LP_ERR_VALUENOTJSON;
+                    break;
+                }
+                g_ptr_array_add( write->keys, g_strdup( key ) );
+                g_ptr_array_add( write->values, g_strdup( valString ) );
+            }
+
+            if ( LP_ERR_NONE == err ) {
+                write_submit( appIdString, write ); /* it replies */
+            } else {
+                errorReplyErr( sh, message, err );
+                write_free( write );
+            }
+        }
+
+        g_free( appIdString );
+        json_object_put( payload );
+    }
+
+    return true;
+} /* appSetValues */
+
+/*!
+\page com_palm_preferences_app_properties
+\n
+\section com_palm_preferences_app_properties_merge_app_property mergeAppProperty
 
 \e Public.
 
-com.palm.preferences/appProperties/getAllAppPropertiesObj
+com.palm.preferences/appProperties/mergeAppProperty
 
-Get all properties set to an application as an object.
+Change part of an application property by applying a JSON merge patch
+(RFC 7386) to it.  Members of the patch replace those of the stored value,
+recursively for objects, and members set to null are removed; everything
+else is left as it was.  A property that doesn't exist yet is created.
 
-\subsection com_palm_preferences_app_properties_get_all_app_properties_obj_syntax Syntax:
+\subsection com_palm_preferences_app_properties_merge_app_property_syntax Syntax:
 \code
 {
-    "appId": string
+    "appId": string,
+    "key": string,
+    "value": object
 }
 \endcode
 
 \param appId Id for the application.
+\param key Key for the property.
+\param value The patch.
 
-\subsection com_palm_preferences_app_properties_get_all_app_properties_obj_returns Returns:
+\subsection com_palm_preferences_app_properties_merge_app_property_returns Returns:
 \code
 {
-    "values": [
-        {
-            "<key>": object
-        },
-        {
-            "<key>": object
-        },
-        ...
-    ],
     "returnValue": boolean,
     "errorText": string
-]
+}
 \endcode
 
-\param values Object array containing the keys and their property objects.
-\param <key> Object containing the property for this key.
 \param returnValue Indicates if the call was succesful.
 \param errorText Describes the error.
 
-\subsection com_palm_preferences_app_properties_get_all_app_properties_obj_examples Examples:
+\subsection com_palm_preferences_app_properties_merge_app_property_examples Examples:
 \code
-luna-send -n 1 -f luna://com.palm.preferences/appProperties/getAllAppPropertiesObj '{"appId": "com.palm.app.calendar"}'
+luna-send -n 1 -f luna://com.palm.preferences/appProperties/mergeAppProperty '{"appId": "com.palm.app.calendar", "key": "oneMoreKey", "value": {"anInt": 5, "anotherInt": null} }'
 \endcode
 
 Example response for a succesful call:
 \code
 {
-    "values": [
-        {
-            "aKey": {
-                "aValue": "lots"
-            }
-        },
-        {
-            "anotherKey": {
-                "anotherValue": "many"
-            }
-        },
-        {
-            "oneMoreKey": {
-                "anInt": 1,
-                "anotherInt": 2
-            }
-        }
-    ],
     "returnValue": true
 }
 \endcode
@@ -1356,173 +2753,176 @@ Example response for a failed call:
 \code
 {
     "returnValue": false,
-    "errorText": "no appId parameter found"
+    "errorText": "illegal value (not a json document)"
 }
-
 \endcode
 */
 static bool
-appGetAllObj( LSHandle* sh, LSMessage* message, void* user_data )
+appMergeValue( LSHandle* sh, LSMessage* message, void* user_data )
 {
-    g_debug( "%s(%s)", __func__, LSMessageGetPayload(message) );
     reset_timer();
-    return appGet_internal( sh, message, LPAppCopyAllCJ, true );
-} /* appGetAllObj */
+
+    g_debug( "%s(%s)", __func__, LSMessageGetPayload(message) );
+
+    struct json_object* payload = json_tokener_parse( LSMessageGetPayload( message ) );
+    if ( !is_error(payload) ) {
+        struct json_object* appId = json_object_object_get( payload, "appId" );
+        struct json_object* key = json_object_object_get( payload, "key");
+        struct json_object* value = json_object_object_get( payload, "value");
+        gchar* appIdString = NULL;
+        gchar* keyString = NULL;
+
+        if ( !getStringParam( appId, &appIdString ) ) {
+            errorReplyStrMissingParam( sh, message, "appId" );
+        } else if ( g_strcmp0(g_strstrip(appIdString),"") == 0) {
+            errorReplyStrMissingParam( sh, message, "appId" );
+        } else if ( !getStringParam( key, &keyString ) ) {
+            errorReplyStrMissingParam( sh, message, "key" );
+        } else if ( !value || !json_object_is_type( value, json_type_object ) ) {
+            errorReplyStrMissingParam( sh, message, "value" );
+        } else {
+            /* Patched when the batch is applied, in its transaction, so the
+               stored document never crosses the bus */
+            PendingWrite* write = write_new( WRITE_PATCH, sh, message );
+            write->key = keyString;
+            keyString = NULL;
+            write->value = g_strdup( json_object_get_string( value ) );
+            write_submit( appIdString, write ); /* it replies */
+        }
+
+        g_free( keyString );
+        g_free( appIdString );
+        json_object_put( payload );
+    }
+
+    return true;
+} /* appMergeValue */
 
 /*!
 \page com_palm_preferences_app_properties
 \n
-\section com_palm_preferences_app_properties_get_app_property getAppProperty
+\section com_palm_preferences_app_properties_remove_app_property removeAppProperty
 
 \e Public.
 
-com.palm.preferences/appProperties/getAppProperty
+com.palm.preferences/appProperties/removeAppProperty
 
-Get an application property for a specific key.
+Remove an application property.
 
-\subsection com_palm_preferences_app_properties_get_app_property_syntax Syntax:
+\subsection com_palm_preferences_app_properties_remove_app_property_syntax Syntax:
 \code
 {
-    "appId": string
+    "appId": string,
+    "key": string
 }
 \endcode
 
 \param appId Id for the application.
+\param key Key for the property that should be removed.
 
-\subsection com_palm_preferences_app_properties_get_app_property_returns Returns:
+\subsection com_palm_preferences_app_properties_remove_app_property_returns Returns:
 \code
 {
-    "<key>": object,
     "returnValue": boolean,
-    "errorText": string
 }
 \endcode
 
-\param <key> Object containing the property for this key.
 \param returnValue Indicates if the call was succesful.
-\param errorText Describes the error.
 
-\subsection com_palm_preferences_app_properties_get_app_property_examples Examples:
+\subsection com_palm_preferences_app_properties_remove_app_property_examples Examples:
 \code
-luna-send -n 1 -f luna://com.palm.preferences/appProperties/getAppProperty '{"appId": "com.palm.app.calendar", "key": "oneMoreKey"}'
+luna-send -n 1 -f luna://com.palm.preferences/appProperties/removeAppProperty '{"appId": "com.palm.app.calendar", "key": "oneMoreKey" }'
 \endcode
 
 Example response for a succesful call:
 \code
 {
-    "oneMoreKey": {
-        "anInt": 1,
-        "anotherInt": 2
-    },
     "returnValue": true
 }
 \endcode
-
-Example response for a failed call:
-\code
-{
-    "returnValue": false,
-    "errorText": "no such key"
-}
-\endcode
 */
 static bool
-appGetValue( LSHandle* sh, LSMessage* message, void* user_data )
+appRemoveValue( LSHandle* sh, LSMessage* message, void* user_data )
 {
     g_debug( "%s(%s)", __func__, LSMessageGetPayload(message) );
     reset_timer();
 
-    LPErr err = -1;           /* not 0 */
-
     gchar* appId = NULL;
     gchar* key = NULL;
+
     if ( parseMessage( message,
                        "appId", json_type_string, &appId,
                        "key", json_type_string, &key,
-                       NULL ) ) {
-        LPAppHandle handle;
-        gchar* value = NULL;
-
-        LSError lserror;
-        LSErrorInit(&lserror);
-
-        err = LPAppGetHandle( appId, &handle );
-        if ( 0 != err ) goto error;
-        err = LPAppCopyValue( handle, key, &value );
-        if ( 0 != err ) goto err_with_handle;
-        if ( !replyWithKeyValue( sh, message, &lserror, key, value ) ) goto err_with_handle;
-        err = 0;
-        LSErrorPrint(&lserror, stderr);
-        FREE_IF_SET (&lserror);
-    err_with_handle:
-        errorReplyErr( sh, message, err );
-        err = LPAppFreeHandle( handle, true );
-        if ( 0 != err ) goto error;
-    error:
-        g_free( appId );
-        g_free( key );
-        g_free( value );
-    } else {
-        errorReplyStr( sh, message, "no appId or key parameter found" );
+                       NULL ) )
+    {
+        PendingWrite* write = write_new( WRITE_REMOVE, sh, message );
+        write->key = key;
+        key = NULL;
+        write_submit( appId, write ); /* it replies */
+    }
+    else
+    {
+        errorReplyStr( sh, message, "'appId'(string)/'key'(string) parameter is missing");
     }
 
+    g_free( appId );
+    g_free( key );
     return true;
-} /* appGetValue */
-
-static bool
-getStringParam( struct json_object* param, char** str )
-{
-    bool ok = !!param
-        && json_object_is_type( param, json_type_string );
-    if ( ok ) {
-        *str = g_strdup( json_object_get_string( param ) );
-    }
-    return ok;
-}
+} /* appRemoveValue */
 
 /*!
 \page com_palm_preferences_app_properties
 \n
-\section com_palm_preferences_app_properties_set_app_property setAppProperty
+\section com_palm_preferences_app_properties_cas_app_property casAppProperty
 
 \e Public.
 
-com.palm.preferences/appProperties/setAppProperty
+com.palm.preferences/appProperties/casAppProperty
 
-Add or change an application property.
+Change an application property only if nobody has changed it since it was
+read, checking and writing in one transaction.  Read it with getAppProperty
+and "returnVersion": true, work out the new value, and pass the version
+along with it.  If the call fails because the version no longer matches,
+read the property again and retry.
 
-\subsection com_palm_preferences_app_properties_set_app_property_syntax Syntax:
+\subsection com_palm_preferences_app_properties_cas_app_property_syntax Syntax:
 \code
 {
     "appId": string,
     "key": string,
-    "value": object
+    "value": object,
+    "version": int
 }
 \endcode
 
 \param appId Id for the application.
 \param key Key for the property.
-\param value Value for the property.
+\param value New value for the property.
+\param version The version the property must still have; 0 if it must not
+exist yet.
 
-\subsection com_palm_preferences_app_properties_set_app_property_returns Returns:
+\subsection com_palm_preferences_app_properties_cas_app_property_returns Returns:
 \code
 {
+    "version": int,
     "returnValue": boolean,
     "errorText": string
 }
 \endcode
 
+\param version The property's new version.
 \param returnValue Indicates if the call was succesful.
 \param errorText Describes the error.
 
-\subsection com_palm_preferences_app_properties_set_app_property_examples Examples:
+\subsection com_palm_preferences_app_properties_cas_app_property_examples Examples:
 \code
-luna-send -n 1 -f luna://com.palm.preferences/appProperties/setAppProperty '{"appId": "com.palm.app.calendar", "key": "oneMoreKey", "value": {"anInt": 1, "anotherInt": 3} }'
+luna-send -n 1 -f luna://com.palm.preferences/appProperties/casAppProperty '{"appId": "com.palm.app.calendar", "key": "oneMoreKey", "value": {"anInt": 2, "anotherInt": 2}, "version": 3 }'
 \endcode
 
 Example response for a succesful call:
 \code
 {
+    "version": 4,
     "returnValue": true
 }
 \endcode
@@ -1531,24 +2931,23 @@ Example response for a failed call:
 \code
 {
     "returnValue": false,
-    "errorText": "illegal value (not a json document)"
+    "errorText": "value has changed since that version"
 }
 \endcode
 */
 static bool
-appSetValue( LSHandle* sh, LSMessage* message, void* user_data )
+appCasValue( LSHandle* sh, LSMessage* message, void* user_data )
 {
     reset_timer();
 
     g_debug( "%s(%s)", __func__, LSMessageGetPayload(message) );
-    bool success = false;
-    LPErr err;
 
     struct json_object* payload = json_tokener_parse( LSMessageGetPayload( message ) );
     if ( !is_error(payload) ) {
         struct json_object* appId = json_object_object_get( payload, "appId" );
         struct json_object* key = json_object_object_get( payload, "key");
         struct json_object* value = json_object_object_get( payload, "value");
+        struct json_object* version = json_object_object_get( payload, "version");
         gchar* appIdString = NULL;
         gchar* keyString = NULL;
 
@@ -1560,69 +2959,179 @@ appSetValue( LSHandle* sh, LSMessage* message, void* user_data )
             errorReplyStrMissingParam( sh, message, "key" );
         } else if ( !value ) {
             errorReplyStrMissingParam( sh, message, "value" );
+        } else if ( !version || !json_object_is_type( version, json_type_int ) ) {
+            errorReplyStrMissingParam( sh, message, "version" );
         } else {
+            /* Not write-behind: the caller has to hear whether it won.
+               pool_get_handle() applies any queued writes first, so the
+               version is checked against everything asked of us before. */
             LPAppHandle handle;
-            err = LPAppGetHandle( appIdString, &handle );
-            if ( 0 != err ) goto err;
+            long long newVersion;
+            LPErr err = pool_get_handle( appIdString, &handle );
+            if ( LP_ERR_NONE == err ) {
+                err = LPAppCompareAndSetValue( handle, keyString,
+                                               json_object_get_int64( version ),
+                                               json_object_get_string( value ),
+                                               &newVersion );
+                LPErr relErr = pool_release_handle( appIdString, handle,
+                                                    LP_ERR_NONE == err );
+                if ( LP_ERR_NONE == err ) {
+                    err = relErr;
+                }
+            }
 
-            gchar* valString = json_object_get_string( value );
-            if ( !!valString ) {
-                err = LPAppSetValue( handle, keyString, valString );
+            if ( LP_ERR_NONE == err ) {
+                struct json_object* result = json_object_new_object();
+                json_object_object_add( result, "version",
+                                        json_object_new_int64( newVersion ) );
+                add_true_result( result );
+
+                LSError lserror;
+                LSErrorInit( &lserror );
+                if ( !replyWithValue( sh, message, &lserror,
+                                      json_object_to_json_string( result ) ) ) {
+                    LSErrorPrint( &lserror, stderr );
+                }
+                FREE_IF_SET( &lserror );
+                json_object_put( result );
+
+                maintain_mark( appIdString );
+                GPtrArray* changed = g_ptr_array_new();
+                g_ptr_array_add( changed, keyString );
+                notify_changes( sh, appIdString, changed );
+                g_ptr_array_free( changed, TRUE );
             } else {
-                err = LP_ERR_VALUENOTJSON;
+                errorReplyErr( sh, message, err );
             }
-
-            (void)LPAppFreeHandle( handle, true );
-            success = LP_ERR_NONE == err;
-        err:
-            errorReplyErr( sh, message, err );
         }
 
         g_free( keyString );
         g_free( appIdString );
         json_object_put( payload );
     }
-    if ( success ) {
-        successReply( sh, message );
-    }
 
     return true;
-} /* appSetValue */
+} /* appCasValue */
+
+/*
+ * Backups under way, each stepped in turn from a low-priority idle source so
+ * they only use time the main loop has nothing else for, and no request
+ * waits on more than APP_BACKUP_PAGES pages' copying.
+ */
+typedef struct PendingBackup {
+    LSHandle*   sh;
+    LSMessage*  message;        /* ref'd until replied to */
+    LPAppBackup backup;
+} PendingBackup;
+
+static GQueue sBackups = G_QUEUE_INIT;
+static bool sBackupScheduled = false;
+
+static void backup_schedule( guint delayMs );
+
+static gboolean
+backupIdleFunc( gpointer data )
+{
+    sBackupScheduled = false;
+    PendingBackup* pending = g_queue_pop_head( &sBackups );
+    if ( NULL == pending ) {
+        return false;
+    }
+    reset_timer();              /* don't quit with a backup half done */
+
+    bool done = false;
+    LPErr err = LPAppBackupStep( pending->backup, APP_BACKUP_PAGES, &done );
+    if ( LP_ERR_BUSY == err ) {
+        g_queue_push_tail( &sBackups, pending );
+        backup_schedule( APP_BACKUP_RETRY_MS );
+    } else {
+        if ( LP_ERR_NONE != err || done ) {
+            LPErr finishErr = LPAppBackupFinish( pending->backup );
+            if ( LP_ERR_NONE == err ) {
+                err = finishErr;
+            }
+            if ( LP_ERR_NONE == err ) {
+                successReply( pending->sh, pending->message );
+            } else {
+                errorReplyErr( pending->sh, pending->message, err );
+            }
+            LSMessageUnref( pending->message );
+            g_free( pending );
+        } else {
+            g_queue_push_tail( &sBackups, pending ); /* take turns */
+        }
+        backup_schedule( 0 );
+    }
+    return false;
+}
+
+/* Whether path names a file of its own directly in APP_BACKUP_DIR */
+static bool
+backup_path_ok( const char* path )
+{
+    if ( !g_str_has_prefix( path, APP_BACKUP_DIR "/" ) ) {
+        return false;
+    }
+    const char* name = path + strlen( APP_BACKUP_DIR "/" );
+    return '\0' != name[0] && NULL == strchr( name, '/' )
+        && 0 != strcmp( name, "." ) && 0 != strcmp( name, ".." );
+}
+
+/* Have the next backup step run, if there is one */
+static void
+backup_schedule( guint delayMs )
+{
+    if ( !sBackupScheduled && !g_queue_is_empty( &sBackups ) ) {
+        sBackupScheduled = true;
+        if ( 0 == delayMs ) {
+            g_idle_add_full( G_PRIORITY_LOW, backupIdleFunc, NULL, NULL );
+        } else {
+            g_timeout_add_full( G_PRIORITY_LOW, delayMs, backupIdleFunc, NULL, NULL );
+        }
+    }
+}
 
 /*!
 \page com_palm_preferences_app_properties
 \n
-\section com_palm_preferences_app_properties_remove_app_property removeAppProperty
+\section com_palm_preferences_app_properties_backup_app_properties backupAppProperties
 
 \e Public.
 
-com.palm.preferences/appProperties/removeAppProperty
+com.palm.preferences/appProperties/backupAppProperties
 
-Remove an application property.
+Copy an application's properties database to a file, while it stays in use.
+The copy is made a little at a time when the service is otherwise idle, so
+it doesn't hold up other calls, and the reply comes once it's complete.
+Nothing is written at the path but a complete copy.  Where all applications
+share one database, that's what is copied.
 
-\subsection com_palm_preferences_app_properties_remove_app_property_syntax Syntax:
+\subsection com_palm_preferences_app_properties_backup_app_properties_syntax Syntax:
 \code
 {
     "appId": string,
-    "key": string
+    "path": string
 }
 \endcode
 
 \param appId Id for the application.
-\param key Key for the property that should be removed.
+\param path Absolute path of the file to copy the database to, which must be
+directly in /var/backups/preferences.
 
-\subsection com_palm_preferences_app_properties_remove_app_property_returns Returns:
+\subsection com_palm_preferences_app_properties_backup_app_properties_returns Returns:
 \code
 {
     "returnValue": boolean,
+    "errorText": string
 }
 \endcode
 
 \param returnValue Indicates if the call was succesful.
+\param errorText Describes the error.
 
-\subsection com_palm_preferences_app_properties_remove_app_property_examples Examples:
+\subsection com_palm_preferences_app_properties_backup_app_properties_examples Examples:
 \code
-luna-send -n 1 -f luna://com.palm.preferences/appProperties/removeAppProperty '{"appId": "com.palm.app.calendar", "key": "oneMoreKey" }'
+luna-send -n 1 -f luna://com.palm.preferences/appProperties/backupAppProperties '{"appId": "com.palm.app.calendar", "path": "/var/backups/preferences/calendar.db"}'
 \endcode
 
 Example response for a succesful call:
@@ -1633,48 +3142,47 @@ Example response for a succesful call:
 \endcode
 */
 static bool
-appRemoveValue( LSHandle* sh, LSMessage* message, void* user_data )
+appBackup( LSHandle* sh, LSMessage* message, void* user_data )
 {
     g_debug( "%s(%s)", __func__, LSMessageGetPayload(message) );
     reset_timer();
 
     gchar* appId = NULL;
-    gchar* key = NULL;
+    gchar* path = NULL;
 
     if ( parseMessage( message,
                        "appId", json_type_string, &appId,
-                       "key", json_type_string, &key,
+                       "path", json_type_string, &path,
                        NULL ) )
     {
-        LPAppHandle handle;
-        LPErr err = LPAppGetHandle( appId, &handle );
-        if ( LP_ERR_NONE == err )
-        {
-            err = LPAppRemoveValue( handle, key );
-            if (LP_ERR_NONE == err)
-            {
-                successReply( sh, message );
-            }
-            else
-            {
-                errorReplyErr( sh, message, err );
-            }
-            (void)LPAppFreeHandle( handle, true );
+        LPAppBackup backup;
+        LPErr err = LP_ERR_PARAM_ERR;
+        if ( backup_path_ok( path ) ) {
+            (void)g_mkdir_with_parents( APP_BACKUP_DIR, 0700 );
+            write_flush_app( appId ); /* what we've said is written goes too */
+            err = LPAppBackupBegin( appId, path, &backup );
         }
-        else
-        {
-            errorReplyErr( sh, message, err);
+        if ( LP_ERR_NONE == err ) {
+            PendingBackup* pending = g_new0( PendingBackup, 1 );
+            pending->sh = sh;
+            pending->message = message;
+            pending->backup = backup;
+            LSMessageRef( message );
+            g_queue_push_tail( &sBackups, pending );
+            backup_schedule( 0 ); /* it replies */
+        } else {
+            errorReplyErr( sh, message, err );
         }
     }
     else
     {
-        errorReplyStr( sh, message, "'appId'(string)/'key'(string) parameter is missing");
+        errorReplyStr( sh, message, "'appId'(string)/'path'(string) parameter is missing");
     }
 
     g_free( appId );
-    g_free( key );
+    g_free( path );
     return true;
-} /* appRemoveValue */
+} /* appBackup */
 
 static LSMethod appPropMethods[] = {
 #ifndef DROP_DEPRECATED
@@ -1688,9 +3196,15 @@ static LSMethod appPropMethods[] = {
    { "getAppKeysObj", appGetKeysObj },
    { "getAllAppProperties", appGetAll },
    { "getAllAppPropertiesObj", appGetAllObj },
+   { "getAppChanges", appGetChanges },
    { "getAppProperty", appGetValue },
+   { "getSomeAppProperties", appGetSome },
    { "setAppProperty", appSetValue },
+   { "setAppProperties", appSetValues },
+   { "mergeAppProperty", appMergeValue },
    { "removeAppProperty", appRemoveValue },
+   { "casAppProperty", appCasValue },
+   { "backupAppProperties", appBackup },
    { },
 };
 
@@ -1737,9 +3251,14 @@ usage( char** argv )
 {
     fprintf( stderr,
              "usage: %s \\\n"
+             "    [-b device] # block device giving storageCapacity (default mmcblk0) \\\n"
              "    [-d]        # enable debug logging \\\n"
              "    [-l]        # log to syslog instead of stderr \\\n"
-             , argv[0] );
+             "    [-j wal|strict] # app DB durability (default strict) \\\n"
+             "    [-k kbytes] # app value cache size, 0 for none (default %d) \\\n"
+             "    [-s]        # keep all apps' properties in one DB \\\n"
+             "    [-w ms]     # hold app writes this long to commit them together (default %d) \\\n"
+             , argv[0], APP_CACHE_KBYTES, APP_WRITE_WINDOW_MS );
 }
 
 int
@@ -1748,16 +3267,42 @@ main( int argc, char** argv )
     bool retVal;
     LSError lserror;
     bool optdone = false;
+    int cacheKBytes = APP_CACHE_KBYTES;
 
     while ( !optdone )
     {
-        switch( getopt( argc, argv, "dl" ) ) {
+        switch( getopt( argc, argv, "b:dlj:k:sw:" ) ) {
+        case 'b':
+            if ( LP_ERR_NONE != LPSystemSetStorageDevice( optarg ) ) {
+                usage( argv );
+                exit( 0 );
+            }
+            break;
         case 'd':
             sLogLevel = G_LOG_LEVEL_DEBUG;
             break;
         case 'l':
             sUseSyslog = true;
             break;
+        case 'j':
+            if ( !strcmp( optarg, "wal" ) ) {
+                (void)LPAppSetDefaultDurability( LP_DURABILITY_WAL );
+            } else if ( !strcmp( optarg, "strict" ) ) {
+                (void)LPAppSetDefaultDurability( LP_DURABILITY_STRICT );
+            } else {
+                usage( argv );
+                exit( 0 );
+            }
+            break;
+        case 'k':
+            cacheKBytes = atoi( optarg );
+            break;
+        case 's':
+            (void)LPAppSetStorageMode( LP_STORAGE_SHARED );
+            break;
+        case 'w':
+            sWriteWindowMs = MAX( 0, atoi( optarg ) );
+            break;
         case -1:
             optdone = true;
             break;
@@ -1767,6 +3312,8 @@ main( int argc, char** argv )
         }
     }
 
+    (void)LPAppSetCacheBudget( cacheKBytes > 0 ? cacheKBytes * 1024 : 0 );
+
     g_log_set_default_handler(logFilter, NULL);
 
     LSErrorInit( &lserror );
@@ -1775,6 +3322,9 @@ main( int argc, char** argv )
 
     g_mainloop = g_main_loop_new( NULL, FALSE );
 
+    /* Keep cached system properties current without having them expire */
+    (void)LPSystemWatchProperties( NULL );
+
     /* Man pages say prefer sigaction() to signal() */
     struct sigaction sact;
     memset( &sact, 0, sizeof(sact) );
@@ -1804,6 +3354,7 @@ main( int argc, char** argv )
     retVal = LSGmainAttachPalmService( psh, g_mainloop, &lserror );
 
     g_main_loop_run( g_mainloop );
+    pool_drain();
     g_main_loop_unref( g_mainloop );
     goto no_error;
 